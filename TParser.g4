@@ -103,7 +103,8 @@ includeStmt: KInclude KList ID ListSearch Path;
 
 listStmt: KList ID (listSearchStmt | listEnumStmt | listInlineEnumStmt | listModifyStmt);
 
-listModifyStmt: (KSort KDesc? KUnique? | KUnique) nl;
+// Token is one of union, intersect and except, which are not reserved words.
+listModifyStmt: (KSort KDesc? KUnique? | KUnique | Token ID) nl;
 
 listSearchStmt: ListSearch Path;
 
@@ -113,7 +114,7 @@ listEnumStmtItem: (ListEnumItem | ListEnumRItem) ListItemToken+ ListItemNL;
 
 listInlineEnumStmt: ListEnum ListItemToken+ ListItemNL nl?;
 
-foreachGroupStmt: KForeach ID (Times ID)* (stmts | fragmentStmts) nl;
+foreachGroupStmt: KForeach (ID | SubID) ((Times | Tilde) (ID | SubID))* (stmts | fragmentStmts) nl;
 
 collectGroupStmt: (Bra collectOperation Ket KAlso | collectOperation) (collectGroupStmt | stmts nl);
 
@@ -152,7 +153,7 @@ templateStmt: KTemplate Token KList ID (stage? NL1 operAlso? | pipeGroup NL1? op
 
 templateInst: TemplateName value+ Exclamation?;
 
-executeStmt: KExecute ListSearch Path nl?;
+executeStmt: KExecute Times? ListSearch Path nl?;
 
 metaStmt: KMeta RuleAppend stage+ nl?;
 
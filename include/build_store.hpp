@@ -0,0 +1,60 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include "mapped_vector.hpp"
+
+namespace parsing {
+    struct build_t;
+
+    // Builds moved out of memory while still being evaluated.
+    // Each spill writes the builds at hand, sorted by art, as a run of its own into
+    // a temporary file; only the arts stay in memory. A build defined again after
+    // being spilled starts afresh in memory, and all of its parts are merged by
+    // build_t::operator+=, oldest first, once evaluation is over.
+    class build_store {
+    public:
+        using builds_t = std::map<std::string, std::shared_ptr<build_t>>;
+
+        explicit build_store(std::string dir) : _dir{ std::move(dir) } { }
+
+        [[nodiscard]] const std::string &dir() const { return _dir; }
+        [[nodiscard]] size_t runs() const { return _runs.size(); }
+        // Every art spilled so far.
+        [[nodiscard]] const std::set<std::string> &arts() const { return _arts; }
+
+        // Write builds out as another run, and empty it.
+        void spill(builds_t &builds);
+        // Call fn on every build of the runs and of builds, merged by art, in order of art;
+        // builds and the store are emptied.
+        void merge(builds_t &builds, const std::function<void(const std::string &, build_t &)> &fn);
+        // Drop the resident pages of the runs; they are read back on demand.
+        void release() const;
+
+    private:
+        std::string _dir;
+        std::deque<mapped_vector<char>> _runs;
+        std::set<std::string> _arts;
+    };
+}
@@ -0,0 +1,119 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TParser.h"
+
+namespace parsing {
+    class TLexer;
+    class rd_parser;
+
+    // Which lexer/parser turns .ajnin into TParser trees.
+    // check runs both and fails if the trees differ.
+    // stream is fast, but one top-level statement at a time.
+    enum class frontend_t {
+        antlr,
+        fast,
+        check,
+        stream,
+    };
+
+    // line, column, is lexical, message
+    using error_fn = std::function<void(size_t, size_t, bool, const std::string &)>;
+
+    // One .ajnin file, lexed and parsed; owns everything the tree points into.
+    class parsed_file {
+    public:
+        // Throws on syntax error, after passing every diagnostic to report (if any).
+        // With frontend_t::stream, nothing is parsed until next().
+        parsed_file(std::unique_ptr<antlr4::CharStream> is, frontend_t frontend, error_fn report = {});
+        ~parsed_file();
+        parsed_file(const parsed_file &) = delete;
+        parsed_file &operator=(const parsed_file &) = delete;
+
+        // nullptr if streaming.
+        [[nodiscard]] TParser::MainContext *tree() const { return _tree; }
+        // Streaming only: the next top-level tree, which lives until the next call; nullptr at EOF.
+        [[nodiscard]] antlr4::ParserRuleContext *next() const;
+        [[nodiscard]] size_t tokens() const;
+        // The most tokens held at once.
+        [[nodiscard]] size_t peak_tokens() const;
+        // Whether SLL prediction failed and the file was parsed again in LL mode.
+        [[nodiscard]] bool retried() const { return _retried; }
+
+    private:
+        error_fn _report;
+        std::unique_ptr<antlr4::CharStream> _is;
+        std::unique_ptr<TLexer> _lexer;
+        std::unique_ptr<antlr4::CommonTokenStream> _tokens;
+        std::unique_ptr<TParser> _parser;
+        std::unique_ptr<rd_parser> _rd;
+        TParser::MainContext *_tree{};
+        size_t _n_tokens{};
+        bool _retried{};
+    };
+
+    // Reads and parses included files on background threads, ahead of evaluation.
+    // Only `include file` statements whose path needs nothing but $/ are followed;
+    // anything else is left to manager::load_file as before.
+    class prefetcher {
+    public:
+        prefetcher(frontend_t frontend, size_t threads);
+        ~prefetcher();
+
+        // Schedule the static includes of tree, which was loaded from a file in dir.
+        void request_includes(TParser::MainContext *tree, const std::filesystem::path &dir);
+        // Wait for path to be parsed; nullptr if it was never scheduled,
+        // failed to parse, or changed on disk since.
+        [[nodiscard]] std::unique_ptr<parsed_file> take(const std::string &path);
+        // Forget everything, as files on disk may have been modified.
+        void invalidate();
+
+    private:
+        struct entry_t {
+            bool done{};
+            std::unique_ptr<parsed_file> result;
+            std::filesystem::file_time_type mtime;
+        };
+
+        const frontend_t _frontend;
+        const size_t _threads;
+        std::mutex _mtx;
+        std::condition_variable _cv_work, _cv_done;
+        std::deque<std::string> _queue;
+        std::map<std::string, entry_t> _entries;
+        std::set<std::string> _seen;
+        size_t _generation{};
+        bool _stop{};
+        std::vector<std::thread> _workers;
+
+        void request(const std::string &path);
+        void work();
+    };
+}
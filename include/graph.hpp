@@ -0,0 +1,112 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "mapped_vector.hpp"
+
+namespace parsing {
+    struct build_t;
+    class build_store;
+
+    // The build graph, frozen once evaluation is over.
+    // Every string is interned; each build is a row of offsets into contiguous
+    // edge and var arrays (compressed sparse row). Build #i has string #i as
+    // its art, so a dep is itself a build iff its id is below size().
+    // Rows are ordered by art. If spilled, the characters, edges and vars live in
+    // temporary files, and only the rows and string offsets stay in memory.
+    class graph {
+    public:
+        using id_t = uint32_t;
+        static constexpr id_t none = UINT32_MAX;
+
+        graph() = default;
+        // Dedups every build (in parallel) and empties builds.
+        // escape is applied once to every string, see ninja().
+        // If store is given, what it holds is merged in and it is emptied as well;
+        // the graph is then spilled into store->dir(), keeping resident memory within budget if not 0.
+        graph(std::map<std::string, std::shared_ptr<build_t>> &builds,
+              const std::map<std::string, std::string> &pools, std::string (*escape)(std::string),
+              build_store *store = nullptr, size_t budget = 0);
+
+        [[nodiscard]] size_t size() const { return _rows.empty() ? 0 : _rows.size() - 1; }
+        [[nodiscard]] bool is_build(id_t s) const { return s < size(); }
+        [[nodiscard]] size_t strings() const { return _strs.size(); }
+        // Views stay valid as long as the graph does.
+        [[nodiscard]] std::string_view str(id_t s) const { return view(_strs[s]); }
+        [[nodiscard]] std::string_view ninja(id_t s) const { return view(_ninja[s]); }
+
+        [[nodiscard]] id_t rule(id_t b) const { return _rows[b].rule; }
+        [[nodiscard]] id_t pool(id_t b) const { return _rows[b].pool; }
+        [[nodiscard]] std::span<const id_t> deps(id_t b) const { return edges(b, 0, 1); }
+        [[nodiscard]] std::span<const id_t> ideps(id_t b) const { return edges(b, 1, 2); }
+        [[nodiscard]] std::span<const id_t> iideps(id_t b) const { return edges(b, 2, 3); }
+        // deps, ideps and iideps altogether.
+        [[nodiscard]] std::span<const id_t> edges(id_t b) const { return edges(b, 0, 3); }
+        [[nodiscard]] std::span<const std::pair<id_t, id_t>> vars(id_t b) const {
+            return { _vars.data() + _rows[b].vars, _vars.data() + _rows[b + 1].vars };
+        }
+
+        // Mark every build reachable from the marked ones through any kind of dep,
+        // one BFS level at a time, each level in parallel. Returns how many were added.
+        size_t reach(std::vector<char> &marked) const;
+
+        // Estimated heap usage; spilled parts excluded.
+        [[nodiscard]] size_t footprint() const;
+
+        // To be called for every build read while emitting. Now and then,
+        // drops what is spilled out of memory if over budget.
+        void trim() const;
+
+    private:
+        struct row_t {
+            id_t rule, pool;
+            size_t edges[3]; // deps, ideps, iideps; each ends where the next one starts.
+            size_t vars;
+        };
+        struct span_t {
+            size_t at, len; // Into _chars.
+        };
+
+        std::vector<span_t> _strs, _ninja; // Where ninja is str, both are the same span.
+        std::vector<row_t> _rows; // Plus a sentinel.
+        mapped_vector<char> _chars;
+        mapped_vector<id_t> _edges;
+        mapped_vector<std::pair<id_t, id_t>> _vars;
+        size_t _budget{};
+        mutable size_t _reads{};
+
+        // Now and then, whether resident memory is over budget.
+        [[nodiscard]] bool over_budget() const;
+        void release() const;
+
+        [[nodiscard]] std::string_view view(span_t sp) const { return { _chars.data() + sp.at, sp.len }; }
+
+        [[nodiscard]] std::span<const id_t> edges(id_t b, size_t from, size_t to) const {
+            auto e = [&](size_t k) { return k < 3 ? _rows[b].edges[k] : _rows[b + 1].edges[0]; };
+            return { _edges.data() + e(from), _edges.data() + e(to) };
+        }
+    };
+}
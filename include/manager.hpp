@@ -17,6 +17,8 @@
 
 #pragma once
 
+#include <boost/container/small_vector.hpp>
+#include <boost/regex.hpp>
 #include <deque>
 #include <filesystem>
 #include <map>
@@ -24,13 +26,23 @@
 #include <optional>
 #include <set>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
 #include "TParser.h"
 #include "TParserBaseVisitor.h"
+#include "build_store.hpp"
 #include "filter.hpp"
+#include "frontend.hpp"
+#include "graph.hpp"
+#include "vars.hpp"
 
 namespace parsing {
     using S = std::string;
     using SS = std::deque<S>;
+    // For the many short lists of strings that are rarely appended to:
+    // no 512-byte deque chunk; the first string is kept inline.
+    using SV = boost::container::small_vector<S, 1>;
     using Ss = std::set<S>;
     using C = char;
     using CS = std::set<char>;
@@ -41,7 +53,7 @@ namespace parsing {
 
     struct rule_t {
         S name;
-        MS<S> vars;
+        vars_t vars;
         Ss ideps, iideps;
 
         rule_t &operator+=(const rule_t &o);
@@ -49,7 +61,7 @@ namespace parsing {
 
     struct list_item_t {
         S name;
-        SS args;
+        SV args;
     };
 
     struct list_t {
@@ -61,9 +73,9 @@ namespace parsing {
     struct build_t {
         S art;
         S rule;
-        SS deps;
+        SV deps;
         Ss ideps, iideps;
-        MS<S> vars;
+        vars_t vars;
         bool dirty{};
 
         build_t &operator+=(build_t &&o);
@@ -71,24 +83,49 @@ namespace parsing {
     };
     using pbuild_t = std::shared_ptr<build_t>;
 
+    // How builds are written out.
+    struct emit_t {
+        bool closure{}; // Also emit whatever the selected builds depend on.
+        size_t fanin{}; // Split phony builds with more deps than this into a tree; 0 for never.
+        bool hoist{}; // Bind variables shared by many builds once at file level.
+        bool prefixes{ true }; // Spell common path prefixes with variables.
+    };
+
+    // How the input is evaluated.
+    struct eval_t {
+        bool lazy_pools{}; // pool := <regex> also covers builds defined afterwards.
+        S exec_cache; // Remembers which execute statements succeeded; empty for nowhere.
+        size_t memory_budget{}; // In bytes; if not 0, builds are spilled to disk to stay within, more or less.
+        S spill_dir; // Where to spill; empty for the temporary directory.
+    };
+
     class manager : public TParserBaseVisitor {
+        // prev never changes while a ctx_t on top of it exists, so what is
+        // inherited is shared with prev, and only copied once written to.
         struct ctx_t {
             ctx_t *prev;
-            MC<list_item_t *> ass;
+            std::shared_ptr<MC<list_item_t *>> ass; // Inherited ones included.
             rule_t zrule;
             MS<rule_t> rules;
-            Ss ideps, iideps;
+            std::shared_ptr<const Ss> ideps, iideps; // Inherited ones included; may be null.
             pbuild_t app;
-            bool app_also;
+            bool app_also{};
+            pbuild_t acc; // Where app was last collected into,
+            std::unordered_set<S> acc_deps; // and its deps,
+            size_t acc_size{}; // the first this many of which.
             std::optional<std::filesystem::path> cwd;
+            const std::filesystem::path *home{}; // The nearest cwd of prev and up.
+            mutable MS<rule_t> resolved; // By operator[](const S &); must be cleared once rules change.
+
+            explicit ctx_t(ctx_t *p);
 
             [[nodiscard]] list_item_t *operator[](const C &s) const;
             [[nodiscard]] rule_t operator[](const S &s) const;
             [[nodiscard]] pbuild_t make_build() const;
-            [[nodiscard]] std::filesystem::path get_cwd() const;
-
-            // Note: Only ass, zrule, rules, ideps, iideps are saved.
-            [[nodiscard]] ctx_t save() const;
+            [[nodiscard]] const std::filesystem::path &get_cwd() const;
+            void assign(C c, list_item_t *item);
+            // Forget zrule, rules, ideps and iideps of this very scope.
+            void reset();
         };
         struct ctx_guard {
             explicit ctx_guard(ctx_t *&p, bool enable = true) : ena{ enable }, value{ p }, ptr{ p } {
@@ -104,6 +141,17 @@ namespace parsing {
             ctx_t *&ptr;
         };
 
+        // A template string cut at every $p and $p0..$p9.
+        struct pattern_t {
+            SS lits; // One more than slots.
+            std::vector<size_t> slots; // Index into args.
+            bool invalid{}; // Ends with a lone $.
+
+            pattern_t(const S &s, C par);
+            [[nodiscard]] bool empty() const { return slots.empty() && lits.front().empty(); }
+            // name and par are only for error messages.
+            [[nodiscard]] S operator()(const SS &args, const S &name, C par) const;
+        };
         struct template_t {
             struct next_t {
                 S art;
@@ -111,21 +159,95 @@ namespace parsing {
                 SS args;
                 bool cas;
             };
+            // builds, arts and nexts, with strings precompiled.
+            struct compiled_t {
+                struct build_c {
+                    pattern_t art;
+                    S rule;
+                    std::vector<pattern_t> deps, ideps, iideps;
+                    std::vector<std::pair<S, pattern_t>> vars;
+                };
+                struct next_c {
+                    pattern_t art;
+                    S name;
+                    std::vector<pattern_t> args;
+                    bool cas;
+                };
+                std::vector<build_c> builds;
+                std::vector<std::pair<S, pattern_t>> arts;
+                std::vector<next_c> nexts;
+            };
             S name;
             C par;
             MS<pbuild_t> builds;
             Ss arts;
             std::deque<next_t> nexts;
+            compiled_t compiled;
+            size_t instantiations{};
 
             template_t &operator+=(template_t &&o);
             bool dedup();
+            // Must be called whenever builds, arts or nexts change.
+            void compile();
         };
 
         MC<list_t> _lists;
         MS<pbuild_t> _builds;
+        // Where _builds goes once too much memory is used; only if memory_budget.
+        std::optional<build_store> _store;
+        size_t _stmts{}; // Statements evaluated, for spill_builds.
         MS<template_t> _templates;
+        // Patched and raw arts passed on to the caller of apply_template.
+        using arts_t = std::deque<std::pair<S, S>>;
+        struct memo_t {
+            bool done;
+            arts_t arts;
+        };
+        // Keyed by template, input artifact, value, and args.
+        // Only valid until any template changes.
+        MS<memo_t> _memo;
         MS<S> _pools;
+        // pool := <regex>, in order; only kept if lazy_pools.
+        struct pool_rule_t {
+            S prefix; // Every match starts with it.
+            boost::regex re;
+            S pool;
+        };
+        std::deque<pool_rule_t> _pool_rules;
+        // How many of _pool_rules had been seen when _pools[art] was assigned.
+        MS<size_t> _pool_stamps;
+        // Launched by execute * but not waited for yet.
+        struct job_t {
+            S cmd, key;
+            int pid;
+        };
+        std::deque<job_t> _jobs;
+        SS _exec_inputs; // Declared by meta since the last execute.
+        std::optional<Ss> _exec_cache; // Keys loaded from eval_t::exec_cache.
+        MS<S> _exec_hits; // Keys known to be good this time, and their commands.
         SS _locations;
+        // Replaces _builds once frozen.
+        graph _graph;
+        bool _frozen{};
+        // Reachable builds of _graph if pruned, otherwise empty.
+        std::vector<char> _live;
+        size_t _fanin_nodes{};
+        // Variables that a ninja rule binds and refers to.
+        struct ninja_rule_t {
+            std::set<S, std::less<>> binds, refs;
+        };
+        // Rules defined in _prolog and the files it includes, scanned on demand.
+        std::optional<std::map<S, ninja_rule_t, std::less<>>> _ninja_rules;
+        // Variables bound at file level in _prolog, or referred to by the rules of its builds.
+        std::set<S, std::less<>> _prolog_vars;
+        // What dump_build keeps for each output file.
+        struct sink_t {
+            std::ostream &os;
+            MS<S> shared; // Phony nodes already emitted, keyed by their deps.
+            std::map<graph::id_t, graph::id_t> hoisted; // Variables bound at file level.
+            SS prefixes; // Bound to $ajn0, $ajn1, ...
+            std::vector<graph::id_t> prefix; // Into prefixes, for every string of _graph.
+        };
 
         ctx_t *_current{};
         list_t *_current_list{};
@@ -145,7 +267,11 @@ namespace parsing {
 
         const bool _debug{}, _quiet{};
         const size_t _debug_limit{};
+        const frontend_t _frontend{};
+        const eval_t _eval{};
+        std::unique_ptr<prefetcher> _prefetch;
         size_t _depth{};
+        size_t _tokens_total{}, _tokens_peak{};
 
         [[nodiscard]] static C as_id(antlr4::tree::TerminalNode *s);
         [[nodiscard]] static S expand_dollar(S s);
@@ -155,13 +281,57 @@ namespace parsing {
         [[nodiscard]] S expand_art(const S &s0) const;
         [[nodiscard]] std::pair<S, bool> expand(const S &s0) const;
         void list_search(const S &s0);
+        // An include list being read, one line at a time.
+        struct list_reader_t {
+            std::deque<list_item_t> &items;
+            list_item_t item;
+            bool empty{ true };
+        };
+        void read_list_line(list_reader_t &rd, std::string_view line);
+        // Names removed by -= but still in _current_list, see flush_removals.
+        std::unordered_set<S> _removals;
+        void flush_removals();
+        void read_list_file(list_reader_t &rd, const S &path);
+        // Run cmd, through /bin/sh if shell, and read its stdout as it arrives.
+        void read_list_command(list_reader_t &rd, const S &cmd, bool shell);
         void art_to_dep();
         void append_artifact();
-        void apply_template(const S &s0, const SS &args, SS *parts);
-        void dump_build(std::ostream &os, const pbuild_t &pb) const;
+        void resolve_pools();
+        // Between statements only, as nothing may refer into _builds then.
+        void spill_builds();
+        // Call fn on every art starting with prefix, spilled or not; some may be seen twice.
+        template <typename Fn>
+        void for_each_art(const S &prefix, Fn &&fn) const {
+            for (auto it = _builds.lower_bound(prefix); it != _builds.end() && it->first.starts_with(prefix); ++it)
+                fn(it->first);
+            if (!_store) return;
+            auto &arts = _store->arts();
+            for (auto it = arts.lower_bound(prefix); it != arts.end() && it->starts_with(prefix); ++it)
+                fn(*it);
+        }
+        // Empty if some input does not exist.
+        [[nodiscard]] S exec_key(const S &cmd, const SS &inputs) const;
+        // Called before anything is read from disk, and before any other execute.
+        void await_executes();
+        void save_exec_cache() const;
+        const arts_t &apply_template(const S &s0, const SS &args, SS *parts);
+        void report_templates() const;
+        // used collects the rules of the builds in text.
+        void scan_ninja_rules(const S &text, Ss &visited, Ss &used);
+        // nullptr if the rule is not defined in _prolog.
+        [[nodiscard]] const ninja_rule_t *ninja_rule(graph::id_t rule) const;
+        void hoist_vars(sink_t &sink, const std::vector<char> &emitted);
+        void compress_prefixes(sink_t &sink, const std::vector<char> &emitted);
+        void put_path(std::ostream &os, const sink_t &sink, graph::id_t s) const;
+        void dump_build(sink_t &sink, graph::id_t b, const emit_t &emit);
+        SS split_fanin(sink_t &sink, SS deps, size_t fanin);
+        [[nodiscard]] std::vector<int> run_filter(const filter &flt, bool closure) const;
 
     public:
-        explicit manager(bool debug = false, bool quiet = false, size_t limit = 15);
+        explicit manager(bool debug = false, bool quiet = false, size_t limit = 15,
+                         frontend_t frontend = frontend_t::antlr, const eval_t &eval = {});
+
+        antlrcpp::Any visitStmt(TParser::StmtContext *ctx) override;
 
         antlrcpp::Any visitDebugStmt(TParser::DebugStmtContext *ctx) override;
 
@@ -187,6 +357,8 @@ namespace parsing {
 
         antlrcpp::Any visitListSearchStmt(TParser::ListSearchStmtContext *ctx) override;
 
+        antlrcpp::Any visitListEnumStmt(TParser::ListEnumStmtContext *ctx) override;
+
         antlrcpp::Any visitListEnumStmtItem(TParser::ListEnumStmtItemContext *ctx) override;
 
         antlrcpp::Any visitListInlineEnumStmt(TParser::ListInlineEnumStmtContext *ctx) override;
@@ -223,16 +395,30 @@ namespace parsing {
 
         antlrcpp::Any visitPoolStmt(TParser::PoolStmtContext *ctx) override;
 
-        void parse(antlr4::CharStream &is);
+        [[nodiscard]] std::unique_ptr<parsed_file> parse(std::unique_ptr<antlr4::CharStream> is);
+
+        // dir is where $/ in the file points to.
+        void evaluate(const parsed_file &pf, const std::filesystem::path &dir);
 
         void load_stream(std::istream &is);
 
         void load_file(const std::string &str, bool flat = false);
 
-        void dump(std::ostream &os, const filter &flt, bool bare = false);
+        // Move _builds into the compact _graph; nothing may be evaluated afterwards.
+        // Called by dump and split_dump.
+        void freeze();
+
+        // Drop builds reachable from neither roots nor, if roots is empty, default.
+        // Freezes if not yet.
+        void prune(const SS &roots);
 
-        void split_dump(const S &out, const filter &flt, const SS &eps, size_t par);
+        void dump(std::ostream &os, const filter &flt, bool bare = false, const emit_t &emit = {});
+
+        void split_dump(const S &out, const filter &flt, const SS &eps, size_t par, const emit_t &emit = {});
 
         static bool collect_deps(const S &fn, bool debug);
+
+        // Print memory usage; only meaningful after profiler::enable().
+        void report(std::ostream &os) const;
     };
 }
@@ -0,0 +1,81 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "antlr4-runtime.h"
+
+namespace parsing {
+    // A CharStream over UTF-8 bytes, decoded on the fly.
+    // Unlike ANTLRInputStream, nothing is ever widened into UTF-32:
+    // pure ASCII input is indexed directly, otherwise the byte offset of
+    // every 64th code point is kept for seek() and getText().
+    class mapped_stream : public antlr4::CharStream {
+    public:
+        // Map the file read-only; only bytes() may be used.
+        // Reading it after the file is truncated raises SIGBUS, so consume it right away.
+        static std::unique_ptr<mapped_stream> open(const std::string &path);
+        // Read the file into a buffer of its own, so that it may change on disk meanwhile.
+        static std::unique_ptr<mapped_stream> load(const std::string &path);
+        // Read is to the end, a chunk at a time, into a buffer of its own.
+        static std::unique_ptr<mapped_stream> read(std::istream &is,
+                                                   std::string name = antlr4::IntStream::UNKNOWN_SOURCE_NAME);
+
+        ~mapped_stream() override;
+        mapped_stream(const mapped_stream &) = delete;
+        mapped_stream &operator=(const mapped_stream &) = delete;
+
+        // The raw UTF-8 content, valid as long as *this.
+        [[nodiscard]] std::string_view bytes() const { return { _data, _len }; }
+
+        void consume() override;
+        size_t LA(ssize_t i) override;
+        ssize_t mark() override { return -1; }
+        void release(ssize_t marker) override { }
+        size_t index() override { return _cp; }
+        void seek(size_t index) override;
+        size_t size() override { return _n_cp; }
+        [[nodiscard]] std::string getSourceName() const override { return _name; }
+        std::string getText(const antlr4::misc::Interval &interval) override;
+        [[nodiscard]] std::string toString() const override { return std::string{ bytes() }; }
+
+    private:
+        static constexpr size_t g_stride = 64;
+
+        std::string _name;
+        std::string _buffer; // Only if not mapped.
+        void *_map{};
+        const char *_data{};
+        size_t _len{};
+
+        size_t _n_cp{};
+        bool _ascii{};
+        std::vector<size_t> _checkpoints;
+        size_t _cp{}, _byte{}; // Current position.
+
+        mapped_stream(std::string name, const char *data, size_t len);
+        void index_bytes();
+        [[nodiscard]] size_t next(size_t byte) const;
+        [[nodiscard]] size_t byte_of(size_t cp) const;
+        [[nodiscard]] size_t decode(size_t byte) const;
+    };
+}
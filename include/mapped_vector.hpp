@@ -0,0 +1,87 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace parsing {
+    // Growable bytes in a mapping of their own: anonymous memory, or a temporary
+    // file (deleted right away), whose pages the kernel may write back and drop
+    // whenever memory is tight. The bytes move while growing, but never otherwise.
+    class mapping {
+    public:
+        mapping() = default;
+        // Spilled into a file under dir, unless dir is empty.
+        explicit mapping(const std::string &dir);
+        mapping(mapping &&o) noexcept;
+        mapping &operator=(mapping &&o) noexcept;
+        ~mapping();
+
+        [[nodiscard]] char *data() const { return _data; }
+        [[nodiscard]] size_t size() const { return _size; }
+        [[nodiscard]] size_t capacity() const { return _cap; }
+        [[nodiscard]] bool spilled() const { return _fd != -1; }
+
+        // Make room for n more bytes at the end, and return where they are.
+        char *extend(size_t n);
+        // Drop the resident pages if spilled; they are read back from the file on demand.
+        void release() const;
+
+        // Resident set size of this process, in bytes.
+        static size_t resident();
+
+    private:
+        char *_data{};
+        size_t _size{}, _cap{};
+        int _fd{ -1 };
+    };
+
+    // A std::vector of plain T, appended only, stored in a mapping.
+    // Elements are moved around as bytes and never destroyed.
+    template <typename T>
+    class mapped_vector {
+        static_assert(std::is_trivially_destructible_v<T> && std::is_standard_layout_v<T>);
+    public:
+        mapped_vector() = default;
+        explicit mapped_vector(const std::string &dir) : _m{ dir } { }
+
+        [[nodiscard]] size_t size() const { return _m.size() / sizeof(T); }
+        [[nodiscard]] bool empty() const { return !_m.size(); }
+        [[nodiscard]] size_t capacity() const { return _m.capacity() / sizeof(T); }
+        [[nodiscard]] bool spilled() const { return _m.spilled(); }
+        [[nodiscard]] const T *data() const { return reinterpret_cast<const T *>(_m.data()); }
+        [[nodiscard]] const T &operator[](size_t i) const { return data()[i]; }
+
+        void push_back(const T &v) { new (_m.extend(sizeof(T))) T{ v }; }
+        template <typename... Args>
+        void emplace_back(Args &&...args) { new (_m.extend(sizeof(T))) T{ std::forward<Args>(args)... }; }
+        // For T = char only.
+        void append(const char *v, size_t n) {
+            if (n) std::memcpy(_m.extend(n), v, n);
+        }
+        void release() const { _m.release(); }
+
+    private:
+        mapping _m;
+    };
+}
@@ -0,0 +1,57 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parsing {
+    // Call f(begin, end) on disjoint ranges covering [0, n), one per hardware thread,
+    // but never on less than grain elements. The first exception thrown is rethrown.
+    template <typename F>
+    void parallel_for(size_t n, const F &f, size_t grain = 1024) {
+        size_t th = std::thread::hardware_concurrency();
+        th = std::clamp<size_t>((n + grain - 1) / grain, 1, std::max<size_t>(th, 1));
+        if (th == 1) {
+            f(size_t{}, n);
+            return;
+        }
+
+        std::exception_ptr ex;
+        std::mutex mtx;
+        std::vector<std::thread> ts;
+        ts.reserve(th);
+        for (size_t i{}; i < th; i++)
+            ts.emplace_back([&, i] {
+                try {
+                    f(n * i / th, n * (i + 1) / th);
+                } catch (...) {
+                    std::lock_guard lock{ mtx };
+                    if (!ex) ex = std::current_exception();
+                }
+            });
+        for (auto &t : ts)
+            t.join();
+        if (ex)
+            std::rethrow_exception(ex);
+    }
+}
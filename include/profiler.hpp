@@ -0,0 +1,41 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+// Allocation accounting for --profile.
+// Every operator new / delete goes thru the counters once enable() is called;
+// allocations are attributed to the innermost live scope of the thread.
+namespace parsing::profiler {
+    void enable();
+    [[nodiscard]] bool enabled();
+
+    struct scope {
+        explicit scope(const std::string &site);
+        ~scope();
+        scope(const scope &) = delete;
+        scope &operator=(const scope &) = delete;
+    private:
+        size_t _prev;
+    };
+
+    void report(std::ostream &os, size_t limit);
+}
@@ -0,0 +1,158 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "TParser.h"
+
+// Hand-written equivalents of TLexer.g4 and TParser.g4.
+// rd_parser builds the very same TParser::*Context trees as TParser does,
+// so the visitors of manager work unchanged on either of them,
+// but without CommonTokenStream buffering nor adaptive prediction.
+// Any change to the grammar must be mirrored here; see --parser check.
+namespace parsing {
+    struct rd_error : std::runtime_error {
+        rd_error(size_t l, size_t c, bool lex, const std::string &msg)
+                : std::runtime_error{ msg }, line{ l }, col{ c }, lexical{ lex } { }
+        size_t line, col;
+        bool lexical;
+    };
+
+    class rd_lexer {
+    public:
+        // src must be the UTF-8 content of is, and must outlive the lexer.
+        rd_lexer(std::string_view src, antlr4::CharStream *is) : _src{ src }, _is{ is } { }
+
+        std::unique_ptr<antlr4::CommonToken> next();
+
+    private:
+        enum mode_t {
+            DEFAULT_MODE,
+            PRE_PATH,
+            LIST_ITEM,
+            LITERAL,
+        };
+
+        std::string_view _src;
+        antlr4::CharStream *_is;
+        mode_t _mode{};
+        size_t _pos{}, _cp{}, _line{ 1 }, _col{};
+        size_t _start_pos{}, _start_cp{}, _start_line{}, _start_col{};
+
+        [[nodiscard]] int peek(size_t k = 0) const;
+        void advance(size_t n = 1);
+        void begin();
+        [[nodiscard]] std::unique_ptr<antlr4::CommonToken> emit(size_t type);
+        [[noreturn]] void fail() const;
+        [[nodiscard]] bool newline(size_t k) const;
+        [[nodiscard]] size_t word(size_t k) const;
+    };
+
+    class rd_parser {
+    public:
+        // Decode is into UTF-8 first.
+        explicit rd_parser(antlr4::CharStream &is);
+        // src must be the UTF-8 content of is, and must outlive the parser.
+        rd_parser(std::string_view src, antlr4::CharStream &is);
+
+        // The returned tree is owned by *this.
+        TParser::MainContext *main();
+        // Parse just the next top-level nl, stmt or literal; nullptr at EOF.
+        // The one returned previously is destroyed, along with its tokens.
+        antlr4::ParserRuleContext *next();
+
+        [[nodiscard]] size_t lexed() const { return _n_lexed; }
+        // The most tokens ever held at once.
+        [[nodiscard]] size_t peak() const { return _peak; }
+
+        // Compare two trees, ignoring NL1 placement which no visitor reads.
+        // Returns the first token of lhs that differs, or nullptr.
+        [[nodiscard]] static antlr4::Token *mismatch(antlr4::tree::ParseTree *lhs, antlr4::tree::ParseTree *rhs);
+
+    private:
+        using ctx_t = antlr4::ParserRuleContext;
+
+        std::string _buffer;
+        rd_lexer _lexer;
+        std::deque<std::unique_ptr<antlr4::CommonToken>> _tokens;
+        std::deque<std::unique_ptr<antlr4::tree::ParseTree>> _nodes;
+        size_t _pos{};
+        size_t _n_lexed{}, _peak{};
+
+        [[nodiscard]] antlr4::Token *LT(size_t k);
+        [[nodiscard]] size_t LA(size_t k) { return LT(k)->getType(); }
+        [[nodiscard]] bool LA_is_stage(size_t k) { return LA(k) == TParser::Stage || LA(k) == TParser::KDefault; }
+        [[nodiscard]] bool LA_is_oper(size_t k) { return LA(k) == TParser::Mult || LA(k) == TParser::Single; }
+        [[nodiscard]] bool LA_is_value(size_t k);
+        [[nodiscard]] bool predict_collect();
+        [[nodiscard]] bool predict_pipe();
+        [[nodiscard]] bool predict_operAlso();
+        [[nodiscard]] bool predict_trailing_nl();
+
+        template <typename T>
+        T *enter(ctx_t *parent);
+        void leave(ctx_t *ctx);
+        void match(ctx_t *ctx, size_t type);
+        void match_opt(ctx_t *ctx, size_t type);
+        [[noreturn]] void fail(const std::string &expecting);
+
+        bool item(ctx_t *p);
+        void stmt(ctx_t *p);
+        void stmts(ctx_t *p);
+        void fragmentStmts(ctx_t *p);
+        void debugStmt(ctx_t *p);
+        void clearStmt(ctx_t *p);
+        void conditionalStmt(ctx_t *p);
+        void ifStmt(ctx_t *p);
+        void ruleStmt(ctx_t *p);
+        void includeStmt(ctx_t *p);
+        void listStmt(ctx_t *p);
+        void listModifyStmt(ctx_t *p);
+        void listSearchStmt(ctx_t *p);
+        void listEnumStmt(ctx_t *p);
+        void listEnumStmtItem(ctx_t *p);
+        void listInlineEnumStmt(ctx_t *p);
+        void foreachGroupStmt(ctx_t *p);
+        void collectGroupStmt(ctx_t *p);
+        void collectOperation(ctx_t *p);
+        void listGroupStmt(ctx_t *p);
+        void pipeStmt(ctx_t *p);
+        void pipeGroup(ctx_t *p);
+        void artifact(ctx_t *p);
+        void pipe(ctx_t *p);
+        void stage(ctx_t *p);
+        void operAlso(ctx_t *p);
+        void operation(ctx_t *p);
+        void alsoGroup(ctx_t *p);
+        void assignment(ctx_t *p);
+        void value(ctx_t *p);
+        void literal(ctx_t *p);
+        void prolog(ctx_t *p);
+        void fileStmt(ctx_t *p);
+        void templateStmt(ctx_t *p);
+        void templateInst(ctx_t *p);
+        void executeStmt(ctx_t *p);
+        void metaStmt(ctx_t *p);
+        void poolStmt(ctx_t *p);
+        void nl(ctx_t *p);
+    };
+}
@@ -0,0 +1,79 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace parsing {
+    // An immutable set of variables.
+    // Sets are hash-consed: equal sets are always the very same object, so
+    // copying one is a pointer copy and comparing two is a pointer comparison.
+    // Every change makes (or finds) another set; the original is untouched.
+    // Not thread-safe; sets must only be created or dropped by one thread at a time.
+    class vars_t {
+    public:
+        using map_t = std::map<std::string, std::string>;
+
+        vars_t() = default; // The empty set, which needs no allocation.
+        explicit vars_t(map_t &&m);
+
+        [[nodiscard]] const map_t &operator*() const { return _node ? _node->map : empty_map(); }
+        [[nodiscard]] map_t::const_iterator begin() const { return (**this).begin(); }
+        [[nodiscard]] map_t::const_iterator end() const { return (**this).end(); }
+        [[nodiscard]] bool empty() const { return !_node; }
+        [[nodiscard]] size_t size() const { return _node ? _node->map.size() : 0; }
+        [[nodiscard]] bool operator==(const vars_t &o) const { return _node == o._node; }
+
+        // nullptr if k is not set.
+        [[nodiscard]] const std::string *find(const std::string &k) const;
+        [[nodiscard]] vars_t with(const std::string &k, std::string v) const;
+        [[nodiscard]] vars_t without(const std::string &k) const;
+        // Where both set a variable, o wins.
+        [[nodiscard]] vars_t merge(const vars_t &o) const;
+
+        // Replace every value v by f(v); *this itself if nothing changes.
+        template <typename F>
+        [[nodiscard]] vars_t transform(const F &f) const {
+            std::optional<map_t> m;
+            for (auto &[k, v] : **this) {
+                auto nv = f(v);
+                if (nv == v) continue;
+                if (!m) m.emplace(**this);
+                m->at(k) = std::move(nv);
+            }
+            return m ? vars_t{ std::move(*m) } : *this;
+        }
+
+        // Call f on every set alive.
+        static void visit(const std::function<void(const map_t &)> &f);
+
+    private:
+        struct node_t {
+            map_t map;
+            size_t hash;
+        };
+        std::shared_ptr<const node_t> _node;
+
+        static const map_t &empty_map();
+    };
+}
@@ -18,10 +18,12 @@
 #include <iostream>
 #include <deque>
 #include <ext/stdio_filebuf.h>
+#include <string_view>
 
 #include "config.h"
 #include "manager.hpp"
 #include "filter.hpp"
+#include "profiler.hpp"
 
 using namespace std::string_literals;
 
@@ -29,17 +31,27 @@ void usage() {
     std::cout << "ajnin " PROJECT_VERSION "\n\n";
     std::cout << "Usage: ajnin  [-h|--help] [-q|--quiet] [-C <chdir>] [-d|--debug] [-o <output>]\n";
     std::cout << "              [-s|--slice <regex>]... [-S|--solo <regex>]... [--bare]\n";
-    std::cout << "              [<input>]\n";
-    std::cout << "Note: -s and -S implies --bare, which cannot be override\n";
+    std::cout << "              [--solo-closure] [--prune] [--root <target>]... [--split-fanin <n>]\n";
+    std::cout << "              [--hoist-vars] [--no-prefix-vars] [--lazy-pools] [--exec-cache <file>]\n";
+    std::cout << "              [--memory-budget <MiB>] [--spill-dir <dir>] [--profile]\n";
+    std::cout << "              [--parser <antlr|fast|check|stream>] [<input>]\n";
+    std::cout << "Note: -s, -S, --prune and --root implies --bare, which cannot be override\n";
     std::cout << "\n";
     std::cout << "Usage: an     [-h|--help] [-q|--quiet] [-C <chdir>] [-o <build.ninja>]\n";
     std::cout << "              [-s|--slice <regex>]... [-S|--solo <regex>]... [--bare]\n";
-    std::cout << "              [-f <build.ajnin>] [<ninja command line arguments>]...\n";
-    std::cout << "Note: -s and -S implies -o '', but can be override\n";
+    std::cout << "              [--solo-closure] [--prune] [--root <target>]... [--split-fanin <n>]\n";
+    std::cout << "              [--hoist-vars] [--no-prefix-vars] [--lazy-pools] [--exec-cache <file>]\n";
+    std::cout << "              [--memory-budget <MiB>] [--spill-dir <dir>] [--profile]\n";
+    std::cout << "              [--parser <antlr|fast|check|stream>] [-f <build.ajnin>]\n";
+    std::cout << "              [<ninja command line arguments>]...\n";
+    std::cout << "Note: -s, -S, --prune and --root implies -o '', but can be override\n";
     std::cout << "\n";
     std::cout << "Usage: sanity [-h|--help] [-q|--quiet] [-C <chdir>]\n";
-    std::cout << "              [-s|--slice <regex>]... [-S|--solo <regex>]...\n";
-    std::cout << "              [-f <build.ajnin>] [-o <sanity.d>]\n";
+    std::cout << "              [-s|--slice <regex>]... [-S|--solo <regex>]... [--solo-closure]\n";
+    std::cout << "              [--prune] [--root <target>]... [--split-fanin <n>] [--hoist-vars]\n";
+    std::cout << "              [--no-prefix-vars] [--lazy-pools] [--exec-cache <file>]\n";
+    std::cout << "              [--memory-budget <MiB>] [--spill-dir <dir>] [--profile]\n";
+    std::cout << "              [--parser <antlr|fast|check|stream>] [-f <build.ajnin>] [-o <sanity.d>]\n";
     std::cout << "              [-j <parallelism>] [<regex>]...\n";
     std::cout << R"(
 Copyright (C) 2021-2023 b1f6c1c4
@@ -61,12 +73,15 @@ along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
 }
 
 int main(int argc, char *argv[]) {
-    auto debug = false, quiet = false, bare = false;
+    auto debug = false, quiet = false, bare = false, prune = false;
+    parsing::emit_t emit;
+    parsing::eval_t eval;
     std::string in, out;
     std::deque<std::string> slices, solos;
     std::vector<const char *> ninja_args{ "ninja" };
-    parsing::SS sanity_args;
+    parsing::SS sanity_args, roots;
     size_t parallelism{};
+    auto frontend = parsing::frontend_t::antlr;
 
     bool ninja, sanity;
     if (std::string_view{ *argv }.ends_with("ajnin"))
@@ -92,7 +107,21 @@ int main(int argc, char *argv[]) {
             debug = true;
         else if (*argv == "-q"s || *argv == "--quiet"s)
             quiet = true;
-        else if (*argv == "-o"s)
+        else if (*argv == "--profile"s)
+            parsing::profiler::enable();
+        else if (*argv == "--parser"s) {
+            if (argv[1] == "antlr"s)
+                frontend = parsing::frontend_t::antlr;
+            else if (argv[1] == "fast"s)
+                frontend = parsing::frontend_t::fast;
+            else if (argv[1] == "check"s)
+                frontend = parsing::frontend_t::check;
+            else if (argv[1] == "stream"s)
+                frontend = parsing::frontend_t::stream;
+            else
+                throw std::runtime_error{ "Unknown parser "s + argv[1] };
+            argc--, argv++;
+        } else if (*argv == "-o"s)
             out = argv[1], argc--, argv++;
         else if (*argv == "-C"s)
             chdir(argv[1]), argc--, argv++;
@@ -106,6 +135,32 @@ int main(int argc, char *argv[]) {
             bare = true;
             if (ninja)
                 out = "";
+        } else if (*argv == "--solo-closure"s)
+            emit.closure = true;
+        else if (*argv == "--hoist-vars"s)
+            emit.hoist = true;
+        else if (*argv == "--no-prefix-vars"s)
+            emit.prefixes = false;
+        else if (*argv == "--lazy-pools"s)
+            eval.lazy_pools = true;
+        else if (*argv == "--exec-cache"s)
+            eval.exec_cache = argv[1], argc--, argv++;
+        else if (*argv == "--memory-budget"s)
+            eval.memory_budget = std::stoul(argv[1]) << 20, argc--, argv++;
+        else if (*argv == "--spill-dir"s)
+            eval.spill_dir = argv[1], argc--, argv++;
+        else if (*argv == "--split-fanin"s) {
+            emit.fanin = std::stoul(argv[1]), argc--, argv++;
+            if (emit.fanin == 1)
+                throw std::runtime_error{ "--split-fanin must be at least 2" };
+        }
+        else if (*argv == "--prune"s || *argv == "--root"s) {
+            if (*argv == "--root"s)
+                roots.emplace_back(argv[1]), argc--, argv++;
+            prune = true;
+            bare = true;
+            if (ninja)
+                out = "";
         } else if ((ninja || sanity) && *argv == "-f"s)
             in = argv[1], argc--, argv++;
         else if (sanity && *argv == "-j"s)
@@ -122,6 +177,21 @@ int main(int argc, char *argv[]) {
             in = argv[0];
     }
 
+    if (solos.empty())
+        emit.closure = false;
+
+    // Whatever ninja is asked to build must survive pruning.
+    if (ninja && prune)
+        for (size_t i{ 1 }; i < ninja_args.size(); i++) {
+            std::string_view a{ ninja_args[i] };
+            if (a == "-t") // What follows is for the tool.
+                break;
+            if (a.size() == 2 && a[0] == '-' && std::string_view{ "jkldw" }.find(a[1]) != std::string_view::npos)
+                i++; // Skip its value.
+            else if (!a.starts_with('-') && !a.ends_with('^'))
+                roots.emplace_back(a);
+        }
+
     auto flt = parsing::cascade_filter{
             std::make_shared<parsing::solo_filter>(solos),
             std::make_shared<parsing::slice_filter>(slices) };
@@ -129,24 +199,32 @@ int main(int argc, char *argv[]) {
     if (sanity) {
         if (!parallelism)
             throw std::runtime_error{ "You forgot -j" };
-        parsing::manager mgr{ debug, quiet };
+        parsing::manager mgr{ debug, quiet, 15, frontend, eval };
         if (in.empty()) {
             mgr.load_stream(std::cin);
         } else {
             mgr.load_file(in);
         }
-        mgr.split_dump(out, flt, sanity_args, parallelism);
+        if (prune)
+            mgr.prune(roots);
+        mgr.split_dump(out, flt, sanity_args, parallelism, emit);
+        if (parsing::profiler::enabled())
+            mgr.report(std::cerr);
         exit(0);
     }
 
     auto execute = [&](std::ostream &os) {
-        parsing::manager mgr{ debug, quiet };
+        parsing::manager mgr{ debug, quiet, 15, frontend, eval };
         if (in.empty()) {
             mgr.load_stream(std::cin);
         } else {
             mgr.load_file(in);
         }
-        mgr.dump(os, flt, bare);
+        if (prune)
+            mgr.prune(roots);
+        mgr.dump(os, flt, bare, emit);
+        if (parsing::profiler::enabled())
+            mgr.report(std::cerr);
     };
 
     if (out.empty()) {
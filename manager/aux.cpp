@@ -31,8 +31,7 @@ rule_t &rule_t::operator+=(const rule_t &o) {
         throw std::runtime_error{ "Cannot add rules under different names" };
     if (!o.name.empty())
         name = o.name;
-    for (auto &[k, v] : o.vars)
-        vars[k] = v;
+    vars = vars.merge(o.vars);
     for (auto &dep : o.ideps)
         ideps.insert(dep);
     for (auto &dep : o.iideps)
@@ -40,47 +39,59 @@ rule_t &rule_t::operator+=(const rule_t &o) {
     return *this;
 }
 
+manager::ctx_t::ctx_t(ctx_t *p) : prev{ p } {
+    if (!prev) {
+        ass = std::make_shared<MC<list_item_t *>>();
+        return;
+    }
+    ass = prev->ass;
+    ideps = prev->ideps;
+    iideps = prev->iideps;
+    home = prev->cwd ? &*prev->cwd : prev->home;
+}
+
 list_item_t *manager::ctx_t::operator[](const C &s) const {
-    if (ass.contains(s)) return ass.at(s);
-    if (!prev) return {};
-    return prev->operator[](s);
+    auto it = ass->find(s);
+    return it == ass->end() ? nullptr : it->second;
 }
 
 rule_t manager::ctx_t::operator[](const S &s) const {
+    if (auto it = resolved.find(s); it != resolved.end())
+        return it->second;
     auto r = prev ? prev->operator[](s) : rule_t{ s };
     r += zrule;
-    if (rules.contains(s)) r += rules.at(s);
-    return r;
+    if (auto it = rules.find(s); it != rules.end())
+        r += it->second;
+    return resolved.emplace(s, std::move(r)).first->second;
 }
 
 pbuild_t manager::ctx_t::make_build() const {
-    auto pb = prev ? prev->make_build() : std::make_shared<build_t>();
-    for (auto &dep : ideps)
-        pb->ideps.insert(dep);
-    for (auto &dep : iideps)
-        pb->iideps.insert(dep);
+    auto pb = std::make_shared<build_t>();
+    if (ideps)
+        pb->ideps = *ideps;
+    if (iideps)
+        pb->iideps = *iideps;
     return pb;
 }
 
-std::filesystem::path manager::ctx_t::get_cwd() const {
+const std::filesystem::path &manager::ctx_t::get_cwd() const {
     if (cwd.has_value()) return cwd.value();
-    if (!prev) throw std::runtime_error{ "Invalid ctx: No cwd" };
-    return prev->get_cwd();
+    if (!home) throw std::runtime_error{ "Invalid ctx: No cwd" };
+    return *home;
 }
 
-manager::ctx_t manager::ctx_t::save() const {
-    if (!prev) return *this;
-    auto ctx = *this;
-    {
-        auto &&p = prev->save();
-        ctx.ass.merge(p.ass);
-        ctx.zrule += p.zrule;
-        for (auto &[k, v] : p.rules)
-            ctx.rules[k] += v;
-        ctx.ideps.merge(p.ideps);
-        ctx.iideps.merge(p.iideps);
-    }
-    return ctx;
+void manager::ctx_t::assign(C c, list_item_t *item) {
+    if (ass.use_count() != 1)
+        ass = std::make_shared<MC<list_item_t *>>(*ass);
+    (*ass)[c] = item;
+}
+
+void manager::ctx_t::reset() {
+    zrule = rule_t{};
+    rules.clear();
+    resolved.clear();
+    ideps = prev ? prev->ideps : nullptr;
+    iideps = prev ? prev->iideps : nullptr;
 }
 
 build_t &build_t::operator+=(build_t &&o) {
@@ -89,7 +100,9 @@ build_t &build_t::operator+=(build_t &&o) {
 
     if (rule != o.rule)
         throw std::runtime_error{ "Conflict rule for " + art };
-    if (!std::equal(vars.begin(), vars.end(), o.vars.begin()))
+    // Equal sets are the same set; o may set more vars than ours, though.
+    if (vars != o.vars
+        && (vars.size() >= o.vars.size() || !std::equal(vars.begin(), vars.end(), o.vars.begin())))
         throw std::runtime_error{ "Conflict var for " + art };
 
     if (!o.deps.empty())
@@ -102,7 +115,7 @@ build_t &build_t::operator+=(build_t &&o) {
 
 bool build_t::dedup() {
     if (!dirty) return false;
-    SS next;
+    SV next;
     Ss seen;
     for (auto &dep : deps)
         if (seen.insert(dep).second)
@@ -142,6 +155,63 @@ bool manager::template_t::dedup() {
     return found;
 }
 
+// Scans exactly like the substitution it replaces did:
+// a $ not followed by par is kept as is, and so is what follows it.
+manager::pattern_t::pattern_t(const S &s, C par) : lits{ S{} } {
+    for (size_t i{}; i < s.size(); i++) {
+        if (s[i] != '$' || i == s.size() - 1 || par != s[i + 1]) {
+            invalid |= s[i] == '$' && i == s.size() - 1;
+            lits.back() += s[i];
+            continue;
+        }
+        if (i != s.size() - 2 && std::isdigit(s[i + 2]))
+            slots.push_back(s[i + 2] - '0' + 1), i += 2;
+        else
+            slots.push_back(0), i++;
+        lits.emplace_back();
+    }
+}
+
+S manager::pattern_t::operator()(const SS &args, const S &name, C par) const {
+    if (invalid) throw std::runtime_error{ "Invalid dep " + name };
+    if (slots.empty()) return lits.front();
+    auto sz = lits.front().size();
+    for (size_t i{}; i < slots.size(); i++) {
+        if (slots[i] >= args.size())
+            throw std::runtime_error{ "Parameter "s + par + " out of range" };
+        sz += args[slots[i]].size() + lits[i + 1].size();
+    }
+    S res;
+    res.reserve(sz);
+    res += lits.front();
+    for (size_t i{}; i < slots.size(); i++)
+        res += args[slots[i]], res += lits[i + 1];
+    return res;
+}
+
+void manager::template_t::compile() {
+    dedup();
+    auto cc = [this](const S &s) { return pattern_t{ s, par }; };
+    auto ccs = [&](const auto &ss) {
+        std::vector<pattern_t> res;
+        res.reserve(ss.size());
+        for (auto &s : ss)
+            res.push_back(cc(s));
+        return res;
+    };
+    compiled = {};
+    for (auto &[k, v] : builds) {
+        auto &b = compiled.builds.emplace_back(compiled_t::build_c{
+                cc(v->art), v->rule, ccs(v->deps), ccs(v->ideps), ccs(v->iideps), {} });
+        for (auto &[va, vl] : v->vars)
+            b.vars.emplace_back(va, cc(vl));
+    }
+    for (auto &a : arts)
+        compiled.arts.emplace_back(a, cc(a));
+    for (auto &n : nexts)
+        compiled.nexts.emplace_back(compiled_t::next_c{ cc(n.art), n.name, ccs(n.args), n.cas });
+}
+
 S manager::expand_dollar(S s) {
     for (auto &c : s)
         if (c == '\e')
@@ -341,6 +411,7 @@ static void glob_search(P directory, PC start, const PC &finish, const S &filena
 void manager::list_search(const S &s0) {
     auto [s, flag] = expand(s0);
     if (!flag) throw std::runtime_error{ "No glob in " + s0 };
+    await_executes();
     auto id = s.find("$$");
 
     std::filesystem::path p{ s };
@@ -21,6 +21,7 @@
 #include <iostream>
 #include <stack>
 #include "TLexer.h"
+#include "profiler.hpp"
 
 using namespace parsing;
 using namespace std::string_literals;
@@ -39,13 +40,23 @@ void manager::append_artifact() {
 
             auto orig_artifact = std::move(_current_artifact);
 
-            auto b = std::make_shared<build_t>(*ptr->app);
-            b->deps.emplace_back(orig_artifact);
-            b->dirty = true;
-
-            auto &pb = _builds[b->art];
+            auto &pb = _builds[ptr->app->art];
             if (!pb) pb = std::make_shared<build_t>();
-            *pb += std::move(*b);
+            if (pb != ptr->acc) { // Otherwise already checked against app.
+                *pb += build_t{ *ptr->app };
+                ptr->acc = pb;
+                ptr->acc_deps.clear();
+                ptr->acc_size = 0;
+            } else if (pb->deps.size() < ptr->acc_size) { // Should deps ever shrink, start over.
+                ptr->acc_deps.clear();
+                ptr->acc_size = 0;
+            }
+            // Whatever other scopes collected into pb meanwhile.
+            ptr->acc_deps.insert(pb->deps.begin() + static_cast<std::ptrdiff_t>(ptr->acc_size), pb->deps.end());
+            // Never store duplicates; pb stays clean if it was.
+            if (ptr->acc_deps.insert(orig_artifact).second)
+                pb->deps.emplace_back(orig_artifact);
+            ptr->acc_size = pb->deps.size();
 
             if (ptr->app_also)
                 _current_artifact = std::move(orig_artifact);
@@ -165,8 +176,7 @@ antlrcpp::Any manager::visitOperation(TParser::OperationContext *ctx) {
             ass->accept(this);
     }
     _current_rule = nullptr;
-    for (auto &[k, v] : rule.vars)
-        _current_build->vars[k] = v;
+    _current_build->vars = _current_build->vars.merge(rule.vars);
     for (auto &dep : rule.ideps)
         _current_build->ideps.insert(dep);
     for (auto &dep : rule.iideps)
@@ -174,8 +184,8 @@ antlrcpp::Any manager::visitOperation(TParser::OperationContext *ctx) {
 
     ctx->stage()->accept(this);
     _current_build->art = _current_artifact;
-    for (auto &[k, v] : _current_build->vars)
-        v = expand_art(v);
+    // Mostly nothing to expand, so the set stays shared with the rule.
+    _current_build->vars = _current_build->vars.transform([this](const S &v) { return expand_art(v); });
 
     auto &pb = _builds[_current_artifact];
     if (!pb) pb = std::make_shared<build_t>();
@@ -205,20 +215,21 @@ antlrcpp::Any manager::visitAssignment(TParser::AssignmentContext *ctx) {
     as = as.substr(1, as.length() - (append ? 3 : 2));
 
     if (!ctx->value()) {
-        _current_rule->vars.erase(as);
+        _current_rule->vars = _current_rule->vars.without(as);
+        _current->resolved.clear(); // In case _current_rule is one of _current.
         return {};
     }
 
     ctx->value()->accept(this);
     auto &rule = _current_rule->name;
     if (append) {
-        if (_current_rule->vars.contains(as))
-            _current_value = _current_rule->vars[as] + _current_value;
-        else
-            _current_value = (*_current)[rule].vars[as] + _current_value;
+        if (auto v = _current_rule->vars.find(as))
+            _current_value = *v + _current_value;
+        else if (auto w = (*_current)[rule].vars.find(as))
+            _current_value = *w + _current_value;
     }
 
-    _current_rule->vars[as] = std::move(_current_value);
+    _current_rule->vars = _current_rule->vars.with(as, std::move(_current_value));
     return {};
 }
 
@@ -277,7 +288,9 @@ antlrcpp::Any manager::visitValue(TParser::ValueContext *ctx) {
 // _current_artifact will be cleared.
 // If parts == nullptr, append_artifact() will be called on each art.
 // If parts != nullptr, all arts will be added to *parts.
-void manager::apply_template(const S &s0, const SS &args, SS *parts) {
+// An instantiation identical to an earlier one only replays its arts,
+// as merging the very same builds into _builds again changes nothing.
+const manager::arts_t &manager::apply_template(const S &s0, const SS &args, SS *parts) {
     if (_debug) {
         std::cerr << std::string(_depth * 2, ' ') << "ajnin: Instantiation template " << s0 << " with arguments:\n";
         for (auto &a : args)
@@ -290,65 +303,74 @@ void manager::apply_template(const S &s0, const SS &args, SS *parts) {
     if (!_templates.contains(s0))
         throw std::runtime_error{ "Template " + s0 + " not found." };
 
+    std::optional<profiler::scope> scope;
+    if (profiler::enabled())
+        scope.emplace("template <" + s0 + ">");
+
     auto &tmpl = _templates.at(s0);
-    tmpl.dedup();
-
-    auto spatch = [&](std::string s) {
-        for (size_t i{}; i < s.size(); i++) {
-            if (s[i] != '$') continue;
-            if (i == s.size() - 1) throw std::runtime_error{ "Invalid dep " + s0 };
-            if (tmpl.par != s[i + 1]) continue;
-            auto [st, sz] = [&]() -> std::pair<S, size_t> {
-                if (i != s.size() - 2 && std::isdigit(s[i + 2])) {
-                    auto v = s[i + 2] - '0';
-                    if (v + 1 >= args.size())
-                        throw std::runtime_error{ "Parameter "s + tmpl.par + " out of range" };
-                    return { args[v + 1], 3 };
-                }
-                return { args[0], 2 };
-            }();
-            s.replace(i, sz, st);
-            i += st.size() - 1;
-        }
-        return std::move(s);
+    auto &cmp = tmpl.compiled;
+    tmpl.instantiations++;
+
+    auto spatch = [&](const pattern_t &p) {
+        return p(args, s0, tmpl.par);
     };
     auto prev_artifact = std::move(_current_artifact);
-    auto patch = [&](build_t b) {
-        for (auto &s : b.deps)
-            s = s.empty() ? s = prev_artifact : spatch(s);
-        Ss next;
-        for (const auto &s : b.ideps)
-            next.emplace(s.empty() ? _current_value : spatch(s));
-        b.ideps = std::move(next);
-        next = {};
-        for (const auto &s : b.iideps)
-            next.emplace(s.empty() ? _current_value : spatch(s));
-        b.iideps = std::move(next);
-        for (auto &[k, v] : b.vars)
-            v = spatch(v);
-        b.art = spatch(b.art);
-        return b;
-    };
 
-    for (auto &[k, v] : tmpl.builds) {
-        auto &&pv = patch(*v);
-        auto &pb = _builds[pv.art]; // note that art is also patched
+    auto key = s0 + '\0' + prev_artifact + '\0' + _current_value;
+    for (auto &a : args)
+        key += '\0', key += a;
+    auto [it, fresh] = _memo.try_emplace(std::move(key), memo_t{});
+    auto &memo = it->second;
+    if (!fresh) {
+        if (!memo.done)
+            throw std::runtime_error{ "Template " + s0 + " instantiates itself." };
+        if (_debug)
+            std::cerr << std::string(_depth * 2, ' ') << "  Notice: same as before, reusing.\n";
+        for (auto &[art, raw] : memo.arts) {
+            _current_artifact = art;
+            if (!parts)
+                append_artifact();
+            else
+                parts->emplace_back(raw);
+        }
+        _current_artifact = {};
+        _current_build = nullptr;
+        return memo.arts;
+    }
+    for (auto &bc : cmp.builds) {
+        build_t b;
+        b.art = spatch(bc.art);
+        b.rule = bc.rule;
+        for (auto &p : bc.deps)
+            b.deps.emplace_back(p.empty() ? prev_artifact : spatch(p));
+        for (auto &p : bc.ideps)
+            b.ideps.emplace(p.empty() ? _current_value : spatch(p));
+        for (auto &p : bc.iideps)
+            b.iideps.emplace(p.empty() ? _current_value : spatch(p));
+        vars_t::map_t vars;
+        for (auto &[k, p] : bc.vars)
+            vars.emplace_hint(vars.end(), k, spatch(p));
+        b.vars = vars_t{ std::move(vars) };
+        auto &pb = _builds[b.art]; // note that art is also patched
         if (!pb) pb = std::make_shared<build_t>();
-        *pb += std::move(pv);
+        *pb += std::move(b);
     }
 
-    for (auto &nxt : tmpl.nexts) {
+    for (auto &nxt : cmp.nexts) {
         _current_artifact = nxt.art.empty() ? prev_artifact : spatch(nxt.art);
         SS na;
         for (auto &a : nxt.args)
             na.emplace_back(spatch(a));
         SS blackhole;
-        apply_template(nxt.name, na, nxt.cas ? parts : &blackhole);
+        auto &sub = apply_template(nxt.name, na, nxt.cas ? parts : &blackhole);
+        if (nxt.cas)
+            memo.arts.insert(memo.arts.end(), sub.begin(), sub.end());
     }
 
-    if (tmpl.nexts.empty())
-        for (auto &art : tmpl.arts) {
-            _current_artifact = spatch(art);
+    if (cmp.nexts.empty())
+        for (auto &[art, p] : cmp.arts) {
+            _current_artifact = spatch(p);
+            memo.arts.emplace_back(_current_artifact, art);
             if (!parts)
                 append_artifact();
             else
@@ -357,6 +379,8 @@ void manager::apply_template(const S &s0, const SS &args, SS *parts) {
 
     _current_artifact = {};
     _current_build = nullptr;
+    memo.done = true;
+    return memo.arts;
 }
 
 // When _current_template is nullptr:
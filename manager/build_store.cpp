@@ -0,0 +1,154 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "build_store.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <queue>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "manager.hpp"
+
+using namespace parsing;
+
+// A build is its art, rule, deps, ideps, iideps and vars, in that order;
+// a string is its uint32_t length and bytes, a list is its uint32_t length and items.
+namespace {
+    void put(mapped_vector<char> &run, uint32_t n) {
+        run.append(reinterpret_cast<const char *>(&n), sizeof(n));
+    }
+
+    void put(mapped_vector<char> &run, std::string_view s) {
+        put(run, static_cast<uint32_t>(s.size()));
+        run.append(s.data(), s.size());
+    }
+
+    template <typename T>
+    void put_all(mapped_vector<char> &run, const T &ss) {
+        put(run, static_cast<uint32_t>(ss.size()));
+        for (auto &s : ss)
+            put(run, s);
+    }
+
+    struct cursor_t {
+        const char *p;
+
+        uint32_t n() {
+            uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            return v;
+        }
+
+        std::string_view str() {
+            auto len = n();
+            std::string_view s{ p, len };
+            p += len;
+            return s;
+        }
+
+        [[nodiscard]] std::string_view peek() const {
+            auto c = *this;
+            return c.str();
+        }
+    };
+}
+
+void build_store::spill(builds_t &builds) {
+    if (builds.empty()) return;
+    auto &run = _runs.emplace_back(_dir);
+    for (auto it = builds.begin(); it != builds.end(); it = builds.erase(it)) {
+        auto &[art, pb] = *it;
+        pb->dedup();
+        put(run, art);
+        put(run, pb->rule);
+        put_all(run, pb->deps);
+        put_all(run, pb->ideps);
+        put_all(run, pb->iideps);
+        put(run, static_cast<uint32_t>(pb->vars.size()));
+        for (auto &[k, v] : pb->vars)
+            put(run, k), put(run, v);
+        _arts.emplace_hint(_arts.end(), art); // Mostly new ones, but not necessarily.
+    }
+    run.release();
+}
+
+void build_store::merge(builds_t &builds, const std::function<void(const std::string &, build_t &)> &fn) {
+    std::vector<cursor_t> cur;
+    std::vector<const char *> end;
+    using head_t = std::pair<std::string_view, size_t>; // Next art of a run, and the run.
+    std::priority_queue<head_t, std::vector<head_t>, std::greater<>> heads;
+    for (auto &run : _runs) {
+        cur.push_back(cursor_t{ run.data() });
+        end.push_back(run.data() + run.size());
+        heads.emplace(cur.back().peek(), cur.size() - 1);
+    }
+
+    auto decode = [&](size_t r) {
+        auto &c = cur[r];
+        build_t b;
+        b.art = c.str();
+        b.rule = c.str();
+        for (auto n = c.n(); n; n--)
+            b.deps.emplace_back(c.str());
+        for (auto n = c.n(); n; n--)
+            b.ideps.emplace_hint(b.ideps.end(), c.str());
+        for (auto n = c.n(); n; n--)
+            b.iideps.emplace_hint(b.iideps.end(), c.str());
+        vars_t::map_t vars;
+        for (auto n = c.n(); n; n--) {
+            S k{ c.str() };
+            vars.emplace_hint(vars.end(), std::move(k), c.str());
+        }
+        b.vars = vars_t{ std::move(vars) };
+        if (c.p != end[r])
+            heads.emplace(c.peek(), r);
+        return b;
+    };
+
+    auto mem = builds.begin();
+    while (!heads.empty() || mem != builds.end()) {
+        if (heads.empty() || (mem != builds.end() && mem->first < heads.top().first)) {
+            fn(mem->first, *mem->second); // Never spilled.
+            mem = builds.erase(mem);
+            continue;
+        }
+        S art{ heads.top().first };
+        build_t acc;
+        // Ties are popped in order of run, which is the order they were defined in.
+        while (!heads.empty() && heads.top().first == art) {
+            auto r = heads.top().second;
+            heads.pop();
+            acc += decode(r);
+        }
+        if (mem != builds.end() && mem->first == art) {
+            acc += build_t{ *mem->second };
+            mem = builds.erase(mem);
+        }
+        acc.dedup();
+        fn(art, acc);
+    }
+    _runs.clear();
+    _arts.clear();
+}
+
+void build_store::release() const {
+    for (auto &run : _runs)
+        run.release();
+}
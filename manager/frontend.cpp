@@ -0,0 +1,259 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "frontend.hpp"
+
+#include "TLexer.h"
+#include "mapped_stream.hpp"
+#include "rd_parser.hpp"
+
+using namespace parsing;
+using namespace std::string_literals;
+
+struct error_listener : antlr4::ANTLRErrorListener {
+    const error_fn *report;
+    size_t errors{};
+
+    void syntaxError(antlr4::Recognizer *recognizer, antlr4::Token *offendingSymbol,
+                     size_t line, size_t charPositionInLine, const std::string &msg,
+                     std::exception_ptr e) override {
+        errors++;
+        if (*report)
+            (*report)(line, charPositionInLine, dynamic_cast<antlr4::Lexer *>(recognizer), msg);
+    }
+    void reportAmbiguity(antlr4::Parser *recognizer, const antlr4::dfa::DFA &dfa, size_t startIndex,
+                         size_t stopIndex, bool exact, const antlrcpp::BitSet &ambigAlts,
+                         antlr4::atn::ATNConfigSet *configs) override { }
+    void reportAttemptingFullContext(antlr4::Parser *recognizer, const antlr4::dfa::DFA &dfa, size_t startIndex,
+                                     size_t stopIndex, const antlrcpp::BitSet &conflictingAlts,
+                                     antlr4::atn::ATNConfigSet *configs) override { }
+    void reportContextSensitivity(antlr4::Parser *recognizer, const antlr4::dfa::DFA &dfa, size_t startIndex,
+                                  size_t stopIndex, size_t prediction,
+                                  antlr4::atn::ATNConfigSet *configs) override { }
+};
+
+parsed_file::parsed_file(std::unique_ptr<antlr4::CharStream> is, frontend_t frontend, error_fn report)
+        : _report{ std::move(report) }, _is{ std::move(is) } {
+    TParser::MainContext *fast{};
+    if (frontend != frontend_t::antlr) {
+        if (auto ms = dynamic_cast<mapped_stream *>(_is.get()))
+            _rd = std::make_unique<rd_parser>(ms->bytes(), *_is);
+        else
+            _rd = std::make_unique<rd_parser>(*_is);
+        if (frontend == frontend_t::stream)
+            return;
+        try {
+            fast = _rd->main();
+        } catch (const rd_error &e) {
+            if (_report)
+                _report(e.line, e.col, e.lexical, e.what());
+            throw std::runtime_error{ "Syntax error detected." };
+        }
+        if (frontend == frontend_t::fast) {
+            _tree = fast;
+            return;
+        }
+        _is->seek(0);
+    }
+
+    error_listener el{};
+    el.report = &_report;
+    using namespace antlr4;
+    _lexer = std::make_unique<TLexer>(_is.get());
+    _lexer->removeErrorListeners();
+    _lexer->addErrorListener(&el);
+    _tokens = std::make_unique<CommonTokenStream>(_lexer.get());
+    _tokens->fill();
+    _n_tokens = _tokens->size();
+    _parser = std::make_unique<TParser>(_tokens.get());
+    _parser->removeErrorListeners();
+    // Two-stage parsing: SLL prediction never needs full-context simulation
+    // and is enough for virtually every input; only if it fails do we rewind
+    // and redo the file in full LL mode, which also gives proper diagnostics.
+    _parser->getInterpreter<atn::ParserATNSimulator>()->setPredictionMode(atn::PredictionMode::SLL);
+    _parser->setErrorHandler(std::make_shared<BailErrorStrategy>());
+    try {
+        _tree = _parser->main();
+    } catch (const ParseCancellationException &) {
+        _retried = true;
+        _tokens->seek(0);
+        _parser->reset();
+        _parser->addErrorListener(&el);
+        _parser->setErrorHandler(std::make_shared<DefaultErrorStrategy>());
+        _parser->getInterpreter<atn::ParserATNSimulator>()->setPredictionMode(atn::PredictionMode::LL);
+        _tree = _parser->main();
+    }
+    _lexer->removeErrorListeners();
+    _parser->removeErrorListeners();
+    // Lexical errors alone are recovered from, but only if someone has been told.
+    if (_parser->getNumberOfSyntaxErrors() || (!_report && el.errors))
+        throw std::runtime_error{ "Syntax error detected." };
+    if (fast)
+        if (auto tok = rd_parser::mismatch(_tree, fast)) {
+            if (_report)
+                _report(tok->getLine(), tok->getCharPositionInLine(), false,
+                       "hand-written parser disagrees with ANTLR near '" + tok->getText() + "'");
+            throw std::runtime_error{ "Parser mismatch detected." };
+        }
+}
+
+parsed_file::~parsed_file() = default;
+
+antlr4::ParserRuleContext *parsed_file::next() const {
+    try {
+        return _rd->next();
+    } catch (const rd_error &e) {
+        if (_report)
+            _report(e.line, e.col, e.lexical, e.what());
+        throw std::runtime_error{ "Syntax error detected." };
+    }
+}
+
+size_t parsed_file::tokens() const {
+    return _rd && !_tokens ? _rd->lexed() : _n_tokens;
+}
+
+size_t parsed_file::peak_tokens() const {
+    return _rd && !_tokens ? _rd->peak() : _n_tokens;
+}
+
+prefetcher::prefetcher(frontend_t frontend, size_t threads) : _frontend{ frontend }, _threads{ threads } { }
+
+prefetcher::~prefetcher() {
+    {
+        std::lock_guard lock{ _mtx };
+        _stop = true;
+        _queue.clear();
+    }
+    _cv_work.notify_all();
+    for (auto &th : _workers)
+        th.join();
+}
+
+static void find_includes(antlr4::tree::ParseTree *t, const std::filesystem::path &dir, std::deque<std::string> &out) {
+    auto ctx = dynamic_cast<TParser::FileStmtContext *>(t);
+    if (!ctx) {
+        for (auto c : t->children)
+            find_includes(c, dir, out);
+        return;
+    }
+    auto s = ctx->Path()->getText();
+    if (!s.ends_with('\n')) return;
+    s.pop_back();
+    // Mirror manager::expand for the only expansion that does not depend on state.
+    for (size_t i{}; i < s.size(); i++) {
+        if (s[i] != '$') continue;
+        if (i == s.size() - 1 || s[i + 1] != '/') return;
+        auto p = dir.string();
+        s.replace(i, 1, p);
+        i += p.size() - 1;
+    }
+    out.push_back(std::move(s));
+}
+
+void prefetcher::request_includes(TParser::MainContext *tree, const std::filesystem::path &dir) {
+    if (!tree) return; // Streaming.
+    std::deque<std::string> paths;
+    find_includes(tree, dir, paths);
+    for (auto &p : paths)
+        request(p);
+}
+
+void prefetcher::request(const std::string &path) {
+    {
+        std::lock_guard lock{ _mtx };
+        if (!_threads || _stop || !_seen.insert(path).second)
+            return;
+        _entries[path];
+        _queue.push_back(path);
+        // Most inputs include nothing, so don't spawn until there is work.
+        if (_workers.empty())
+            for (size_t i{}; i < _threads; i++)
+                _workers.emplace_back(&prefetcher::work, this);
+    }
+    _cv_work.notify_one();
+}
+
+std::unique_ptr<parsed_file> prefetcher::take(const std::string &path) {
+    std::unique_lock lock{ _mtx };
+    auto it = _entries.find(path);
+    if (it == _entries.end())
+        return nullptr;
+    auto gen = _generation;
+    _cv_done.wait(lock, [&] { return _generation != gen || it->second.done; });
+    if (_generation != gen)
+        return nullptr;
+    auto res = std::move(it->second.result);
+    auto mtime = it->second.mtime;
+    _entries.erase(it);
+    lock.unlock();
+
+    std::error_code ec;
+    if (res && std::filesystem::last_write_time(path, ec) != mtime)
+        return nullptr;
+    return res;
+}
+
+void prefetcher::invalidate() {
+    {
+        std::lock_guard lock{ _mtx };
+        _generation++;
+        _queue.clear();
+        _entries.clear();
+        _seen.clear();
+    }
+    _cv_done.notify_all();
+}
+
+void prefetcher::work() {
+    while (true) {
+        std::string path;
+        size_t gen;
+        {
+            std::unique_lock lock{ _mtx };
+            _cv_work.wait(lock, [this] { return _stop || !_queue.empty(); });
+            if (_stop)
+                return;
+            path = std::move(_queue.front());
+            _queue.pop_front();
+            gen = _generation;
+        }
+
+        std::unique_ptr<parsed_file> res;
+        std::filesystem::file_time_type mtime;
+        try {
+            if (std::filesystem::is_regular_file(path)) {
+                mtime = std::filesystem::last_write_time(path);
+                res = std::make_unique<parsed_file>(mapped_stream::load(path), _frontend);
+                request_includes(res->tree(), std::filesystem::path{ path }.parent_path().lexically_normal());
+            }
+        } catch (const std::exception &) {
+            res.reset(); // Let load_file do it again and report the error in context.
+        }
+
+        {
+            std::lock_guard lock{ _mtx };
+            if (gen != _generation)
+                continue;
+            auto &e = _entries[path];
+            e.done = true;
+            e.result = std::move(res);
+            e.mtime = mtime;
+        }
+        _cv_done.notify_all();
+    }
+}
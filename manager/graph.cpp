@@ -0,0 +1,183 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "graph.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string_view>
+#include <unordered_map>
+#include "build_store.hpp"
+#include "manager.hpp"
+#include "parallel.hpp"
+
+using namespace parsing;
+
+// How often trim() looks at the resident memory.
+static constexpr size_t g_trim_every = 4096;
+
+graph::graph(std::map<std::string, std::shared_ptr<build_t>> &builds,
+             const std::map<std::string, std::string> &pools, std::string (*escape)(std::string),
+             build_store *store, size_t budget)
+        : _chars{ store ? store->dir() : std::string{} }, _edges{ store ? store->dir() : std::string{} },
+          _vars{ store ? store->dir() : std::string{} }, _budget{ budget } {
+    // The same build may be registered under more than one art.
+    std::vector<build_t *> uniq;
+    uniq.reserve(builds.size());
+    for (auto &[art, pb] : builds)
+        uniq.push_back(pb.get());
+    std::sort(uniq.begin(), uniq.end());
+    uniq.erase(std::unique(uniq.begin(), uniq.end()), uniq.end());
+    parallel_for(uniq.size(), [&](size_t b, size_t e) {
+        for (auto i = b; i < e; i++)
+            uniq[i]->dedup();
+    }, 64);
+    uniq = {};
+
+    // By hash only, so that nothing points into _chars while it grows.
+    std::unordered_multimap<size_t, id_t> ids;
+    auto intern = [&](std::string_view s) {
+        auto h = std::hash<std::string_view>{}(s);
+        auto [b, e] = ids.equal_range(h);
+        for (auto it = b; it != e; ++it)
+            if (str(it->second) == s)
+                return it->second;
+        auto id = static_cast<id_t>(_strs.size());
+        _strs.push_back(span_t{ _chars.size(), s.size() });
+        _chars.append(s.data(), s.size());
+        ids.emplace(h, id);
+        return id;
+    };
+
+    // Spilled or not, builds #i has string #i as its art.
+    static const std::set<std::string> no_arts;
+    auto &spilled = store ? store->arts() : no_arts;
+    auto sit = spilled.begin();
+    for (auto &[art, pb] : builds) {
+        for (; sit != spilled.end() && *sit < art; ++sit)
+            intern(*sit);
+        if (sit != spilled.end() && *sit == art)
+            ++sit;
+        intern(art);
+    }
+    for (; sit != spilled.end(); ++sit)
+        intern(*sit);
+
+    // Each build is gone as soon as its row is done.
+    _rows.reserve(_strs.size() + 1);
+    auto row = [&](const std::string &art, const build_t &b) {
+        auto &r = _rows.emplace_back();
+        r.rule = intern(b.rule);
+        auto pit = pools.find(art);
+        r.pool = pit == pools.end() ? none : intern(pit->second);
+        r.edges[0] = _edges.size();
+        for (auto &dep : b.deps)
+            _edges.push_back(intern(dep));
+        r.edges[1] = _edges.size();
+        for (auto &dep : b.ideps)
+            _edges.push_back(intern(dep));
+        r.edges[2] = _edges.size();
+        for (auto &dep : b.iideps)
+            _edges.push_back(intern(dep));
+        r.vars = _vars.size();
+        for (auto &[va, vl] : b.vars)
+            _vars.emplace_back(intern(va), intern(vl));
+        if (over_budget()) {
+            release();
+            if (store)
+                store->release();
+        }
+    };
+    if (store)
+        store->merge(builds, row);
+    else
+        for (auto it = builds.begin(); it != builds.end(); it = builds.erase(it))
+            row(it->first, *it->second);
+    _rows.push_back(row_t{ none, none, { _edges.size(), _edges.size(), _edges.size() }, _vars.size() });
+    ids = {};
+
+    // A block at a time, as the escaped strings are held in memory until appended.
+    _ninja.reserve(_strs.size());
+    std::vector<std::string> esc;
+    for (size_t b0{}; b0 < _strs.size(); b0 += 64 * 1024) {
+        esc.resize(std::min<size_t>(_strs.size() - b0, 64 * 1024));
+        parallel_for(esc.size(), [&](size_t b, size_t e) {
+            for (auto i = b; i < e; i++)
+                esc[i] = escape(std::string{ str(b0 + i) });
+        });
+        for (size_t i{}; i < esc.size(); i++, trim()) {
+            if (esc[i] == str(b0 + i)) {
+                _ninja.push_back(_strs[b0 + i]);
+                continue;
+            }
+            _ninja.push_back(span_t{ _chars.size(), esc[i].size() });
+            _chars.append(esc[i].data(), esc[i].size());
+        }
+    }
+}
+
+size_t graph::reach(std::vector<char> &marked) const {
+    std::vector<id_t> frontier;
+    for (id_t b{}; b < size(); b++)
+        if (marked[b])
+            frontier.push_back(b);
+
+    size_t cnt{};
+    std::mutex mtx;
+    while (!frontier.empty()) {
+        std::vector<id_t> next;
+        parallel_for(frontier.size(), [&](size_t b, size_t e) {
+            std::vector<id_t> local;
+            for (auto i = b; i < e; i++)
+                for (auto dep : edges(frontier[i]))
+                    if (is_build(dep) && !std::atomic_ref{ marked[dep] }.exchange(1, std::memory_order_relaxed))
+                        local.push_back(dep);
+            std::lock_guard lock{ mtx };
+            next.insert(next.end(), local.begin(), local.end());
+        }, 256);
+        cnt += next.size();
+        frontier = std::move(next);
+    }
+    return cnt;
+}
+
+size_t graph::footprint() const {
+    auto sz = (_strs.capacity() + _ninja.capacity()) * sizeof(span_t) + _rows.capacity() * sizeof(row_t);
+    if (!_chars.spilled())
+        sz += _chars.capacity() + _edges.capacity() * sizeof(id_t)
+              + _vars.capacity() * sizeof(std::pair<id_t, id_t>);
+    return sz;
+}
+
+void graph::trim() const {
+    if (over_budget())
+        release();
+}
+
+bool graph::over_budget() const {
+    if (!_budget || !_chars.spilled() || _reads++ % g_trim_every)
+        return false;
+    return mapping::resident() > _budget;
+}
+
+void graph::release() const {
+    _chars.release();
+    _edges.release();
+    _vars.release();
+}
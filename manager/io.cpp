@@ -17,15 +17,26 @@
 
 #include "manager.hpp"
 
+#include <algorithm>
 #include <boost/regex.hpp>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
-#include "TLexer.h"
+#include <malloc.h>
+#include <sstream>
+#include <unordered_map>
+#include "mapped_stream.hpp"
+#include "parallel.hpp"
+#include "profiler.hpp"
 
 using namespace parsing;
 using namespace std::string_literals;
 
-manager::manager(bool debug, bool quiet, size_t limit) : _debug{ debug }, _debug_limit{ limit }, _quiet{ quiet } { }
+manager::manager(bool debug, bool quiet, size_t limit, frontend_t frontend, const eval_t &eval)
+        : _debug{ debug }, _quiet{ quiet }, _debug_limit{ limit }, _frontend{ frontend }, _eval{ eval } {
+    if (_eval.memory_budget)
+        _store.emplace(_eval.spill_dir.empty() ? std::filesystem::temp_directory_path().string() : _eval.spill_dir);
+}
 
 antlrcpp::Any manager::visitProlog(TParser::PrologContext *ctx) {
     if (ctx->LiteralEmptyText()) {
@@ -43,6 +54,19 @@ antlrcpp::Any manager::visitProlog(TParser::PrologContext *ctx) {
     return {};
 }
 
+antlrcpp::Any manager::visitStmt(TParser::StmtContext *ctx) {
+    if (!profiler::enabled()) {
+        visitChildren(ctx);
+        spill_builds();
+        return {};
+    }
+    auto tok = ctx->getStart();
+    profiler::scope scope{ tok->getInputStream()->getSourceName() + ":" + std::to_string(tok->getLine()) };
+    visitChildren(ctx);
+    spill_builds();
+    return {};
+}
+
 antlrcpp::Any manager::visitFileStmt(TParser::FileStmtContext *ctx) {
     auto s0 = ctx->Path()->getText();
     if (!s0.ends_with('\n')) throw std::runtime_error{ "Lexer messed up with \\n" };
@@ -60,113 +84,509 @@ antlrcpp::Any manager::visitFileStmt(TParser::FileStmtContext *ctx) {
     return {};
 }
 
-struct error_listener : antlr4::ANTLRErrorListener {
-    const SS *prev_locations;
+static void report_error(const SS &prev_locations, const S &source, size_t line, size_t col,
+                         bool lexical, const S &msg) {
+    for (auto &loc : prev_locations) {
+        if (&loc == &prev_locations.front())
+            std::cerr << "In file included from ";
+        else
+            std::cerr << "                 from ";
+        std::cerr << loc;
+        if (&loc != &prev_locations.back())
+            std::cerr << ",\n";
+        else
+            std::cerr << ":\n";
+    }
+    std::cerr << source << ":" << line << ":" << col + 1 << ": ";
+    if (lexical)
+        std::cerr << "\e[31mlexical error\e[0m: ";
+    else
+        std::cerr << "\e[31msyntax error\e[0m: ";
+    std::cerr << msg << "\n";
+}
 
-    void syntaxError(antlr4::Recognizer *recognizer, antlr4::Token *offendingSymbol,
-                     size_t line, size_t charPositionInLine, const std::string &msg,
-                     std::exception_ptr e) override {
-        for (auto &loc : *prev_locations) {
-            if (&loc == &prev_locations->front())
-                std::cerr << "In file included from ";
-            else
-                std::cerr << "                 from ";
-            std::cerr << loc;
-            if (&loc != &prev_locations->back())
-                std::cerr << ",\n";
-            else
-                std::cerr << ":\n";
-        }
-        std::cerr << recognizer->getInputStream()->getSourceName();
-        std::cerr << ":" << line << ":" << charPositionInLine + 1 << ": ";
-        if (auto lexer = dynamic_cast<antlr4::Lexer *>(recognizer); lexer)
-            std::cerr << "\e[31mlexical error\e[0m: ";
-        if (auto parser = dynamic_cast<antlr4::Parser *>(recognizer); parser)
-            std::cerr << "\e[31msyntax error\e[0m: ";
-        std::cerr << msg << "\n";
-    }
-    void reportAmbiguity(antlr4::Parser *recognizer, const antlr4::dfa::DFA &dfa, size_t startIndex,
-                         size_t stopIndex, bool exact, const antlrcpp::BitSet &ambigAlts,
-                         antlr4::atn::ATNConfigSet *configs) override { }
-    void reportAttemptingFullContext(antlr4::Parser *recognizer, const antlr4::dfa::DFA &dfa, size_t startIndex,
-                                     size_t stopIndex, const antlrcpp::BitSet &conflictingAlts,
-                                     antlr4::atn::ATNConfigSet *configs) override { }
-    void reportContextSensitivity(antlr4::Parser *recognizer, const antlr4::dfa::DFA &dfa, size_t startIndex,
-                                  size_t stopIndex, size_t prediction,
-                                  antlr4::atn::ATNConfigSet *configs) override { }
-};
-
-void manager::parse(antlr4::CharStream &is) {
-    error_listener el{};
-    el.prev_locations = &_locations;
-    using namespace antlr4;
-    TLexer lexer{ &is };
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&el);
-    CommonTokenStream tokens{ &lexer };
-    tokens.fill();
-    TParser parser{ &tokens };
-    parser.removeErrorListeners();
-    parser.addErrorListener(&el);
-    auto res = parser.main();
-    if (parser.getNumberOfSyntaxErrors())
-        throw std::runtime_error{ "Syntax error detected." };
-    res->accept(this);
+std::unique_ptr<parsed_file> manager::parse(std::unique_ptr<antlr4::CharStream> is) {
+    auto src = is->getSourceName();
+    auto pf = std::make_unique<parsed_file>(std::move(is), _frontend,
+            [this, src](size_t line, size_t col, bool lexical, const S &msg) {
+                report_error(_locations, src, line, col, lexical, msg);
+            });
+    if (_debug && pf->retried())
+        std::cerr << std::string(_depth * 2, ' ') << "ajnin: SLL failed, retrying in LL mode\n";
+    return pf;
+}
+
+void manager::evaluate(const parsed_file &pf, const std::filesystem::path &dir) {
+    if (pf.tree()) {
+        if (_prefetch)
+            _prefetch->request_includes(pf.tree(), dir);
+        pf.tree()->accept(this);
+    } else {
+        while (auto t = pf.next())
+            t->accept(this);
+    }
+    _tokens_total += pf.tokens();
+    _tokens_peak = std::max(_tokens_peak, pf.peak_tokens());
 }
 
 void manager::load_stream(std::istream &is) {
-    antlr4::ANTLRInputStream s{ is };
+    auto top = !_prefetch;
+    if (top)
+        _prefetch = std::make_unique<prefetcher>(_frontend, std::thread::hardware_concurrency());
+    auto pf = parse(mapped_stream::read(is));
     ctx_guard next{ _current };
     _current->cwd = std::filesystem::current_path();
-    parse(s);
+    evaluate(*pf, *_current->cwd);
+    if (top) {
+        await_executes();
+        save_exec_cache();
+        _prefetch.reset();
+    }
 }
 
 void manager::load_file(const std::string &str, bool flat) {
-    antlr4::ANTLRFileStream s{};
     if (_debug)
         std::cerr << std::string(_depth * 2, ' ') << "ajnin: Loading file " << str << "\n";
     _ajnin_deps.insert(str);
+    await_executes();
+    auto top = !_prefetch;
+    if (top)
+        _prefetch = std::make_unique<prefetcher>(_frontend, std::thread::hardware_concurrency());
     _depth++;
-    s.loadFromFile(str);
+    std::optional<profiler::scope> scope;
+    if (profiler::enabled())
+        scope.emplace("file " + str);
+    auto pf = _prefetch->take(str);
+    if (!pf)
+        pf = parse(mapped_stream::load(str)); // Not mapped, see mapped_stream::open.
+    auto dir = std::filesystem::path{ str }.parent_path().lexically_normal();
     if (flat) {
         auto old_cwd = std::move(_current->cwd);
-        _current->cwd = str;
-        _current->cwd = _current->cwd->parent_path().lexically_normal();
-        parse(s);
+        _current->cwd = dir;
+        evaluate(*pf, dir);
         _current->cwd = std::move(old_cwd);
     } else {
         ctx_guard next{ _current };
-        _current->cwd = str;
-        _current->cwd = _current->cwd->parent_path().lexically_normal();
-        parse(s);
+        _current->cwd = dir;
+        evaluate(*pf, dir);
     }
     _depth--;
+    if (top) {
+        await_executes();
+        save_exec_cache();
+        _prefetch.reset();
+    }
 }
 
-void manager::dump_build(std::ostream &os, const pbuild_t &pb) const {
-    const auto &art = pb->art;
-    if (art == "default")
-        os << "default";
-    else
-        os << "build " << manager::expand_ninja(art) << ": " << manager::expand_ninja(pb->rule);
-    for (auto &dep : pb->deps)
-        os << " " << manager::expand_ninja(dep);
-    if (!pb->ideps.empty()) {
+// The last pool statement covering an art wins, no matter when its build was defined.
+void manager::resolve_pools() {
+    for (auto i = _pool_rules.size(); i--;) {
+        auto &[prefix, re, pool] = _pool_rules[i];
+        for_each_art(prefix, [&](const S &art) {
+            auto &stamp = _pool_stamps[art];
+            if (stamp > i || !boost::regex_match(art, re))
+                return;
+            _pools[art] = pool;
+            stamp = SIZE_MAX; // Settled by a later rule.
+        });
+    }
+    _pool_rules.clear();
+    _pool_stamps.clear();
+}
+
+void manager::freeze() {
+    if (_frozen) return;
+    resolve_pools();
+    _graph = graph{ _builds, _pools, &manager::expand_ninja, _store ? &*_store : nullptr, _eval.memory_budget };
+    _frozen = true;
+}
+
+static constexpr size_t g_spill_every = 4096;
+
+// Not too often, as reading the resident memory takes a system call or two;
+// and not too few builds at once, as every spill is merged back in the end.
+void manager::spill_builds() {
+    if (!_store || _current_template || ++_stmts % g_spill_every || _builds.size() < g_spill_every)
+        return;
+    if (mapping::resident() <= _eval.memory_budget)
+        return;
+    _store->spill(_builds);
+    malloc_trim(0); // Otherwise what is freed is mostly kept resident.
+}
+
+void manager::prune(const SS &roots) {
+    freeze();
+    auto n = _graph.size();
+    std::vector<char> live(n);
+    if (roots.empty()) {
+        for (graph::id_t b{}; b < n; b++)
+            live[b] = _graph.str(b) == "default";
+        if (std::find(live.begin(), live.end(), 1) == live.end()) {
+            if (!_quiet)
+                std::cerr << "ajnin: Warning: Nothing to prune without default\n";
+            return;
+        }
+    } else {
+        Ss the_roots(roots.begin(), roots.end());
+        for (graph::id_t b{}; b < n; b++)
+            live[b] = the_roots.erase(manager::expand_dollar(S{ _graph.str(b) })) != 0;
+        for (auto &r : the_roots)
+            std::cerr << "ajnin: Warning: Root " << r << " is not a build\n";
+    }
+    size_t cnt = n - std::count(live.begin(), live.end(), 1);
+    cnt -= _graph.reach(live);
+    _live = std::move(live);
+    if (!_quiet)
+        std::cerr << "ajnin: Pruned " << cnt << " unreachable builds\n";
+}
+
+// Builds are filtered by their expanded art; -1 means excluded, and so are pruned ones.
+// With closure, everything reachable from a +1 is +1 as well.
+std::vector<int> manager::run_filter(const filter &flt, bool closure) const {
+    std::vector<int> res(_graph.size());
+    parallel_for(res.size(), [&](size_t b, size_t e) {
+        for (auto i = b; i < e; i++)
+            res[i] = !_live.empty() && !_live[i] ? -1 : flt(manager::expand_dollar(S{ _graph.str(i) }));
+    }, 256);
+    if (!closure)
+        return res;
+
+    std::vector<char> marked(res.size());
+    for (size_t i{}; i < res.size(); i++)
+        marked[i] = res[i] == +1;
+    auto cnt = _graph.reach(marked);
+    for (size_t i{}; i < res.size(); i++)
+        if (marked[i]) res[i] = +1;
+    if (!_quiet)
+        std::cerr << "ajnin: Closure added " << cnt << " builds\n";
+    return res;
+}
+
+// Add the names of the variables that ninja text refers to.
+static void ninja_refs(std::string_view s, std::set<S, std::less<>> &refs) {
+    for (size_t i{}; i + 1 < s.size(); i++) {
+        if (s[i] != '$') continue;
+        if (s[++i] == '{') {
+            auto e = s.find('}', i);
+            if (e == std::string_view::npos) return;
+            refs.emplace(s.substr(i + 1, e - i - 1));
+            i = e;
+            continue;
+        }
+        auto b = i;
+        while (i < s.size() && (std::isalnum(static_cast<unsigned char>(s[i])) || s[i] == '_' || s[i] == '-'))
+            i++;
+        if (i > b)
+            refs.emplace(s.substr(b, i-- - b));
+    }
+}
+
+static S trim(const S &s) {
+    auto b = s.find_first_not_of(' ');
+    if (b == S::npos) return {};
+    return s.substr(b, s.find_last_not_of(' ') - b + 1);
+}
+
+void manager::scan_ninja_rules(const S &text, Ss &visited, Ss &used) {
+    ninja_rule_t *cur{};
+    for (size_t pos{}; pos < text.size();) {
+        S line;
+        while (pos < text.size()) { // $ at the end of a line continues it.
+            auto e = std::min(text.find('\n', pos), text.size());
+            line.append(text, pos, e - pos);
+            pos = e + 1;
+            auto d = line.size() - std::min(line.size(), line.find_last_not_of('$') + 1);
+            if (d % 2 == 0) break;
+            line.pop_back();
+            while (pos < text.size() && text[pos] == ' ')
+                pos++;
+        }
+        auto t = trim(line);
+        if (t.empty() || t.starts_with('#'))
+            continue;
+        if (line.starts_with(' ')) {
+            auto eq = t.find('=');
+            if (!cur || eq == S::npos) continue;
+            cur->binds.emplace(trim(t.substr(0, eq)));
+            ninja_refs(std::string_view{ t }.substr(eq + 1), cur->refs);
+            continue;
+        }
+        cur = nullptr;
+        if (t.starts_with("rule ")) {
+            cur = &(*_ninja_rules)[trim(t.substr(5))];
+        } else if (t.starts_with("build ")) {
+            auto colon = t.find(':'); // Not $: though.
+            while (colon != S::npos && (colon - 1 - t.find_last_not_of('$', colon - 1)) % 2)
+                colon = t.find(':', colon + 1);
+            if (colon == S::npos) continue;
+            auto r = trim(t.substr(colon + 1));
+            used.emplace(r.substr(0, r.find(' ')));
+        } else if (t.starts_with("include ")) {
+            auto path = trim(t.substr(8));
+            if (path.find('$') != S::npos || !visited.emplace(path).second) continue;
+            std::ifstream ifs{ path };
+            if (!ifs) continue; // Its rules remain unknown.
+            std::stringstream ss;
+            ss << ifs.rdbuf();
+            scan_ninja_rules(ss.str(), visited, used);
+        } else if (auto eq = t.find('='); eq != S::npos && !t.starts_with("pool ")
+                   && !t.starts_with("default ") && !t.starts_with("subninja ")) {
+            _prolog_vars.emplace(trim(t.substr(0, eq)));
+        }
+    }
+}
+
+const manager::ninja_rule_t *manager::ninja_rule(graph::id_t rule) const {
+    static const ninja_rule_t phony{};
+    auto name = _graph.str(rule);
+    if (name == "phony") return &phony;
+    auto it = _ninja_rules->find(name);
+    return it == _ninja_rules->end() ? nullptr : &it->second;
+}
+
+// Bind at file level the most common value of each variable, and drop it from the builds,
+// as long as ninja sees no difference. Ninja looks a variable up in the build, the rule,
+// and then the file; build and file bindings are evaluated right away.
+// So nothing may refer to a hoisted variable except rules, and then every build of such
+// a rule must bind it. Builds of unknown rules, or of rules binding it, keep their bindings.
+// Nor may _prolog bind it at file level, or have builds whose rules refer to it.
+void manager::hoist_vars(sink_t &sink, const std::vector<char> &emitted) {
+    if (!_ninja_rules) {
+        _ninja_rules.emplace();
+        S text;
+        for (auto &t : _prolog)
+            text += manager::expand_dollar(t), text += '\n';
+        Ss visited, used;
+        scan_ninja_rules(text, visited, used);
+        // Builds of _prolog see what is bound at file level last, too.
+        for (auto &r : used)
+            if (auto it = _ninja_rules->find(r); it != _ninja_rules->end())
+                _prolog_vars.insert(it->second.refs.begin(), it->second.refs.end());
+    }
+
+    auto builds = [&](auto &&fn) {
+        for (graph::id_t b{}; b < emitted.size(); b++, _graph.trim())
+            if (emitted[b] && _graph.str(b) != "default")
+                fn(b);
+    };
+
+    std::set<S, std::less<>> referred;
+    std::map<graph::id_t, std::map<graph::id_t, size_t>> counts;
+    builds([&](graph::id_t b) {
+        auto rule = ninja_rule(_graph.rule(b));
+        for (auto [va, vl] : _graph.vars(b)) {
+            ninja_refs(_graph.ninja(vl), referred);
+            if (rule && !rule->binds.contains(_graph.str(va)) && _graph.str(vl).find('\e') == S::npos)
+                counts[va][vl]++;
+        }
+    });
+
+    std::map<graph::id_t, graph::id_t> hoisted;
+    for (auto &[va, m] : counts) {
+        if (referred.contains(_graph.str(va)) || _prolog_vars.contains(_graph.str(va))) continue;
+        auto it = std::max_element(m.begin(), m.end(), [](auto &l, auto &r) { return l.second < r.second; });
+        if (it->second >= 2)
+            hoisted.emplace(va, it->first);
+    }
+
+    builds([&](graph::id_t b) {
+        auto rule = ninja_rule(_graph.rule(b));
+        auto vars = _graph.vars(b);
+        std::erase_if(hoisted, [&](auto &p) {
+            auto name = _graph.str(p.first);
+            if (rule && (!rule->refs.contains(name) || rule->binds.contains(name)))
+                return false;
+            return std::none_of(vars.begin(), vars.end(), [&](auto &v) { return v.first == p.first; });
+        });
+    });
+
+    MS<graph::id_t> lines; // Sorted by name.
+    size_t cnt{};
+    for (auto [va, vl] : hoisted) {
+        lines.emplace(_graph.ninja(va), vl);
+        cnt += counts[va][vl];
+    }
+    for (auto &[va, vl] : lines)
+        sink.os << va << " = " << _graph.ninja(vl) << '\n';
+    if (!_quiet && !hoisted.empty())
+        std::cerr << "ajnin: Hoisted " << hoisted.size() << " variables out of " << cnt << " bindings\n";
+    sink.hoisted = std::move(hoisted);
+}
+
+// A prefix must save this many bytes per use, on top of the 7 of ${ajn0} if not nested,
+// and be used this many times.
+static constexpr size_t g_prefix_gain = 8;
+static constexpr size_t g_prefix_uses = 16;
+
+// Bind to variables those directories that many paths in the output start with,
+// the longer and the more often the better; a directory may be bound relative to
+// the closest one already bound. Directories referring to variables that some build
+// binds are left alone, as ninja evaluates paths in the scope of their build.
+void manager::compress_prefixes(sink_t &sink, const std::vector<char> &emitted) {
+    std::vector<size_t> uses(_graph.strings());
+    Ss bound;
+    for (graph::id_t b{}; b < emitted.size(); b++, _graph.trim()) {
+        if (!emitted[b]) continue;
+        if (_graph.str(b) != "default")
+            uses[b]++;
+        for (auto dep : _graph.edges(b))
+            uses[dep]++;
+        for (auto [va, vl] : _graph.vars(b))
+            bound.emplace(_graph.str(va));
+    }
+    if (std::any_of(bound.begin(), bound.end(), [](auto &va) { return va.starts_with("ajn"); }))
+        return; // Would shadow ours.
+
+    std::unordered_map<std::string_view, size_t> weights;
+    for (graph::id_t s{}; s < uses.size(); s++) {
+        if (!uses[s]) continue;
+        std::string_view t{ _graph.ninja(s) };
+        for (auto pos = t.find('/'); pos != std::string_view::npos; pos = t.find('/', pos + 1))
+            weights[t.substr(0, pos + 1)] += uses[s];
+    }
+    std::vector<std::pair<std::string_view, size_t>> cands;
+    for (auto &[p, w] : weights)
+        if (w >= g_prefix_uses && p.size() >= 7 + g_prefix_gain)
+            cands.emplace_back(p, w);
+    std::sort(cands.begin(), cands.end(), [](auto &l, auto &r) {
+        return l.first.size() != r.first.size() ? l.first.size() < r.first.size() : l.first < r.first;
+    });
+
+    std::unordered_map<std::string_view, graph::id_t> chosen;
+    for (auto &[p, w] : cands) {
+        size_t base{};
+        auto parent = graph::none;
+        for (auto pos = p.size() - 1; pos-- > 0;)
+            if (p[pos] == '/')
+                if (auto it = chosen.find(p.substr(0, pos + 1)); it != chosen.end()) {
+                    base = pos + 1, parent = it->second;
+                    break;
+                }
+        if (p.size() < base + (parent == graph::none ? 7 : 0) + g_prefix_gain)
+            continue;
+        std::set<S, std::less<>> refs;
+        ninja_refs(p, refs);
+        if (std::any_of(refs.begin(), refs.end(), [&](auto &r) { return bound.contains(r); }))
+            continue;
+
+        auto k = static_cast<graph::id_t>(sink.prefixes.size());
+        chosen.emplace(p, k);
+        sink.prefixes.emplace_back(p);
+        sink.os << "ajn" << k << " = ";
+        if (parent != graph::none)
+            sink.os << "${ajn" << parent << "}";
+        sink.os << p.substr(base) << '\n';
+    }
+    if (chosen.empty())
+        return;
+
+    size_t cnt{};
+    sink.prefix.assign(uses.size(), graph::none);
+    for (graph::id_t s{}; s < uses.size(); s++) {
+        if (!uses[s]) continue;
+        std::string_view t{ _graph.ninja(s) };
+        for (auto pos = t.size(); pos-- > 0;)
+            if (t[pos] == '/')
+                if (auto it = chosen.find(t.substr(0, pos + 1)); it != chosen.end()) {
+                    sink.prefix[s] = it->second;
+                    cnt += uses[s];
+                    break;
+                }
+    }
+    if (!_quiet)
+        std::cerr << "ajnin: Shortened " << cnt << " paths with " << chosen.size() << " prefixes\n";
+}
+
+void manager::put_path(std::ostream &os, const sink_t &sink, graph::id_t s) const {
+    auto k = sink.prefix.empty() ? graph::none : sink.prefix[s];
+    if (k == graph::none) {
+        os << _graph.ninja(s);
+        return;
+    }
+    os << "${ajn" << k << "}" << std::string_view{ _graph.ninja(s) }.substr(sink.prefixes[k].size());
+}
+
+// Group deps into phony nodes of at most fanin deps each, level by level,
+// and return what is left on top. Identical groups are emitted only once.
+SS manager::split_fanin(sink_t &sink, SS deps, size_t fanin) {
+    while (deps.size() > fanin) {
+        SS next;
+        for (size_t i{}; i < deps.size(); i += fanin) {
+            auto e = std::min(deps.size(), i + fanin);
+            S key;
+            for (auto j = i; j < e; j++)
+                key += deps[j], key += '\0';
+            auto &name = sink.shared[key];
+            if (name.empty()) {
+                name = "ajnin.fanin." + std::to_string(_fanin_nodes++);
+                sink.os << "build " << name << ": phony";
+                for (auto j = i; j < e; j++)
+                    sink.os << " " << deps[j];
+                sink.os << '\n';
+            }
+            next.emplace_back(name);
+        }
+        deps = std::move(next);
+    }
+    return deps;
+}
+
+void manager::dump_build(sink_t &sink, graph::id_t b, const emit_t &emit) {
+    auto &os = sink.os;
+    auto deps = _graph.deps(b);
+    // default is a statement of its own rather than a build, so it is never split.
+    if (emit.fanin && deps.size() > emit.fanin && _graph.str(_graph.rule(b)) == "phony"
+        && _graph.str(b) != "default") {
+        SS the_deps;
+        for (auto dep : deps) {
+            std::ostringstream oss;
+            put_path(oss, sink, dep);
+            the_deps.emplace_back(oss.str());
+        }
+        the_deps = split_fanin(sink, std::move(the_deps), emit.fanin);
+        os << "build ";
+        put_path(os, sink, b);
+        os << ": phony";
+        for (auto &dep : the_deps)
+            os << " " << dep;
+    } else {
+        if (_graph.str(b) == "default") {
+            os << "default";
+        } else {
+            os << "build ";
+            put_path(os, sink, b);
+            os << ": " << _graph.ninja(_graph.rule(b));
+        }
+        for (auto dep : deps)
+            os << " ", put_path(os, sink, dep);
+    }
+    if (!_graph.ideps(b).empty()) {
         os << " |";
-        for (auto &dep : pb->ideps)
-            os << " " << manager::expand_ninja(dep);
+        for (auto dep : _graph.ideps(b))
+            os << " ", put_path(os, sink, dep);
     }
-    if (!pb->iideps.empty()) {
+    if (!_graph.iideps(b).empty()) {
         os << " ||";
-        for (auto &dep : pb->iideps)
-            os << " " << manager::expand_ninja(dep);
+        for (auto dep : _graph.iideps(b))
+            os << " ", put_path(os, sink, dep);
+    }
+    std::vector<std::pair<graph::id_t, graph::id_t>> vars;
+    for (auto [va, vl] : _graph.vars(b)) {
+        auto it = sink.hoisted.find(va);
+        if (it != sink.hoisted.end() && it->second == vl) {
+            auto rule = ninja_rule(_graph.rule(b));
+            if (rule && !rule->binds.contains(_graph.str(va)))
+                continue;
+        }
+        vars.emplace_back(va, vl);
     }
-    if (!pb->vars.empty() || _pools.contains(art)) {
+    auto pool = _graph.pool(b);
+    if (!vars.empty() || pool != graph::none) {
         os << '\n';
-        for (auto &[va, vl] : pb->vars)
-            os << "    " << manager::expand_ninja(va) << " = " << manager::expand_ninja(vl) << '\n';
-        if (_pools.contains(art))
-            os << "    pool = " << _pools.at(art) << "\n";
+        for (auto [va, vl] : vars)
+            os << "    " << _graph.ninja(va) << " = " << _graph.ninja(vl) << '\n';
+        if (pool != graph::none)
+            os << "    pool = " << _graph.str(pool) << "\n";
     }
     os << '\n';
 }
@@ -174,21 +594,34 @@ void manager::dump_build(std::ostream &os, const pbuild_t &pb) const {
 static constexpr char g_ninja_prolog1[] = "# ajnin deps: ";
 static constexpr char g_ninja_prolog2[] = "# No more ajnin deps.";
 
-void manager::dump(std::ostream &os, const filter &flt, bool bare) {
+void manager::report_templates() const {
+    std::vector<std::pair<size_t, const S *>> order;
+    for (auto &[k, t] : _templates)
+        order.emplace_back(t.instantiations, &k);
+    std::stable_sort(order.begin(), order.end(), [](auto &l, auto &r) { return l.first > r.first; });
+    for (size_t i{}; i < order.size() && i < _debug_limit; i++)
+        std::cerr << "ajnin: Template " << *order[i].second << " instantiated "
+                  << order[i].first << " times\n";
+}
+
+void manager::dump(std::ostream &os, const filter &flt, bool bare, const emit_t &emit) {
+    if (_debug)
+        report_templates();
+    freeze();
+    auto n = _graph.size();
     if (!_quiet)
-        std::cerr << "ajnin: Emitting " << _builds.size() << " builds\n";
+        std::cerr << "ajnin: Emitting " << n << " builds\n";
 
-    S max_deps_art;
+    auto max_deps_art = graph::none;
     size_t max_deps{};
-    for (auto &[art, pb] : _builds) {
-        pb->dedup();
-        if (pb->deps.size() > max_deps) {
-            max_deps_art = art;
-            max_deps = pb->deps.size();
+    for (graph::id_t b{}; b < n; b++)
+        if (_graph.deps(b).size() > max_deps) {
+            max_deps_art = b;
+            max_deps = _graph.deps(b).size();
         }
-    }
     if (!_quiet)
-        std::cerr << "ajnin: Largest fanin is " << max_deps << " deps (" << max_deps_art << ")\n";
+        std::cerr << "ajnin: Largest fanin is " << max_deps << " deps ("
+                  << (max_deps_art == graph::none ? S{} : _graph.str(max_deps_art)) << ")\n";
 
     if (!bare) {
         os << "# This file is automatically generated by ajnin. DO NOT MODIFY.\n";
@@ -200,17 +633,29 @@ void manager::dump(std::ostream &os, const filter &flt, bool bare) {
     for (auto &t : _prolog)
         os << manager::expand_dollar(t) << '\n';
 
+    auto verdicts = run_filter(flt, emit.closure);
+    sink_t sink{ os };
+    if (emit.hoist || emit.prefixes) {
+        std::vector<char> emitted(n);
+        for (graph::id_t b{}; b < n; b++)
+            emitted[b] = verdicts[b] != -1;
+        if (emit.hoist)
+            hoist_vars(sink, emitted);
+        if (emit.prefixes)
+            compress_prefixes(sink, emitted);
+    }
+
     size_t cnt{};
-    for (auto &[art, pb] : _builds) {
-        if (flt(manager::expand_dollar(art)) == -1)
+    for (graph::id_t b{}; b < n; b++, _graph.trim()) {
+        if (verdicts[b] == -1)
             continue;
 
         cnt++;
-        dump_build(os, pb);
+        dump_build(sink, b, emit);
     }
 
     if (!_quiet)
-        std::cerr << "ajnin: Emitted " << cnt << " out of " << _builds.size() << " builds\n";
+        std::cerr << "ajnin: Emitted " << cnt << " out of " << n << " builds\n";
 }
 
 bool manager::collect_deps(const S &fn, bool debug) {
@@ -245,7 +690,11 @@ bool manager::collect_deps(const S &fn, bool debug) {
     auto good = true;
     for (auto &dep : deps) {
         std::filesystem::path p{ dep };
-        if (!std::filesystem::exists(p)) {
+        if (dep.starts_with('!')) {
+            if (debug)
+                std::cerr << "ajnin: Info: meta-dep " << dep << " is a command and must be run again.\n";
+            good = false;
+        } else if (!std::filesystem::exists(p)) {
             if (debug)
                 std::cerr << "ajnin: Info: meta-dep " << dep << " does not exist.\n";
             good = false;
@@ -264,78 +713,80 @@ bool manager::collect_deps(const S &fn, bool debug) {
 antlrcpp::Any manager::visitMetaStmt(TParser::MetaStmtContext *ctx) {
     for (auto &s : ctx->stage()) {
         s->accept(this);
+        if (!_eval.exec_cache.empty())
+            _exec_inputs.push_back(_current_artifact);
         _ajnin_deps.emplace(std::move(_current_artifact));
     }
     return {};
 }
 
-void manager::split_dump(const S &out, const filter &flt, const SS &eps, size_t par) {
+void manager::split_dump(const S &out, const filter &flt, const SS &eps, size_t par, const emit_t &emit) {
     std::deque<boost::regex> the_eps;
     for (auto &s : eps)
         the_eps.emplace_back(s);
 
+    if (_debug)
+        report_templates();
+    freeze();
+    auto n = _graph.size();
+
     // none: Unassigned
     // 0: Assigned to the common file
     // 1 ~ par: Assigned to a split file
-    MS<size_t> assignment;
-    SS queue;
+    constexpr auto none = static_cast<size_t>(-1);
+    std::vector<size_t> assignment(n, none);
+    std::deque<graph::id_t> queue;
     std::vector<size_t> cnts(par + 1);
 
     if (!_quiet)
-        std::cerr << "ajnin: Finding endpoints from " << _builds.size() << " builds\n";
+        std::cerr << "ajnin: Finding endpoints from " << n << " builds\n";
+
+    auto verdicts = run_filter(flt, emit.closure);
 
     // Initial round-robin assignment
     size_t cnt_total{};
-    for (auto &[art, pb] : _builds) {
-        if (art == "default") continue;
-        auto the_art = manager::expand_dollar(art);
-        if (flt(the_art) == -1) continue;
+    for (graph::id_t b{}; b < n; b++) {
+        if (_graph.str(b) == "default") continue;
+        if (verdicts[b] == -1) continue;
+        auto the_art = manager::expand_dollar(S{ _graph.str(b) });
         cnt_total++;
         for (auto &re : the_eps) {
             boost::smatch m;
             if (!boost::regex_match(the_art, m, re)) continue;
             auto s = m.size() >= 2 ? m[1] : m[0];
-            cnts[assignment[art] = 1 + (std::hash<S>{}(s) % par)]++;
-            queue.emplace_back(art);
+            cnts[assignment[b] = 1 + (std::hash<S>{}(s) % par)]++;
+            queue.emplace_back(b);
         }
     }
 
     if (!_quiet)
-        std::cerr << "ajnin: Spliting " << cnt_total << "/" << _builds.size() << " builds "
+        std::cerr << "ajnin: Spliting " << cnt_total << "/" << n << " builds "
                   << "with " << queue.size() << " endpoints into " << par << " files, "
                   << "avg. " << queue.size() / par << " ep/file.\n";
 
     // Adjusting assignment
     while (!queue.empty()) {
-        auto art = queue.front();
+        auto b = queue.front();
         queue.pop_front();
-        auto pb = _builds.at(art);
-        auto ass = assignment.at(art);
-
-        auto fix = [&](const S &dep) {
-            if (!_builds.contains(dep)) return;
-            if (flt(manager::expand_dollar(dep)) == -1) return;
-            auto it = assignment.find(dep);
-            if (it == assignment.end()) {
-                assignment[dep] = ass;
+        auto ass = assignment[b];
+
+        for (auto dep : _graph.edges(b)) {
+            if (!_graph.is_build(dep)) continue;
+            if (verdicts[dep] == -1) continue;
+            auto &a = assignment[dep];
+            if (a == none) {
+                a = ass;
                 cnts[ass]++;
                 queue.emplace_back(dep);
-            } else if (!it->second || it->second == ass) {
+            } else if (!a || a == ass) {
                 // do nothing
             } else {
-                cnts[it->second]--;
-                it->second = 0;
+                cnts[a]--;
+                a = 0;
                 cnts[0]++;
                 queue.emplace_back(dep);
             }
-        };
-
-        for (auto &dep : pb->deps)
-            fix(dep);
-        for (auto &idep : pb->ideps)
-            fix(idep);
-        for (auto &iidep : pb->iideps)
-            fix(iidep);
+        }
     }
 
     if (!_quiet) {
@@ -365,15 +816,28 @@ void manager::split_dump(const S &out, const filter &flt, const SS &eps, size_t
         for (auto &t : _prolog)
             *pos << manager::expand_dollar(t) << '\n';
 
+    // Every file is a manifest of its own, so nothing is shared among them.
+    std::deque<sink_t> sinks;
+    for (size_t i{}; i <= par; i++) {
+        auto &sink = sinks.emplace_back(*ofss[i]);
+        if (!emit.hoist && !emit.prefixes) continue;
+        std::vector<char> emitted(n);
+        for (graph::id_t b{}; b < n; b++)
+            emitted[b] = assignment[b] == i;
+        if (emit.hoist)
+            hoist_vars(sink, emitted);
+        if (emit.prefixes)
+            compress_prefixes(sink, emitted);
+    }
+
     size_t cnt{};
-    for (auto &[art, pb] : _builds) {
-        auto it = assignment.find(art);
-        if (it == assignment.end()) continue;
+    for (graph::id_t b{}; b < n; b++, _graph.trim()) {
+        if (assignment[b] == none) continue;
 
         cnt++;
-        dump_build(*ofss[it->second], pb);
+        dump_build(sinks[assignment[b]], b, emit);
     }
 
     if (!_quiet)
-        std::cerr << "ajnin: Emitted " << cnt << " out of " << cnt_total << "/" << _builds.size() << " builds\n";
+        std::cerr << "ajnin: Emitted " << cnt << " out of " << cnt_total << "/" << n << " builds\n";
 }
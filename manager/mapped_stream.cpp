@@ -0,0 +1,184 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mapped_stream.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace parsing;
+
+mapped_stream::mapped_stream(std::string name, const char *data, size_t len)
+        : _name{ std::move(name) }, _data{ data }, _len{ len } { }
+
+std::unique_ptr<mapped_stream> mapped_stream::open(const std::string &path) {
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        throw std::runtime_error{ "Cannot open file " + path };
+    struct stat st{};
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw std::runtime_error{ "Cannot stat file " + path };
+    }
+    void *map{};
+    auto len = static_cast<size_t>(st.st_size);
+    if (len) { // mmap refuses empty mappings.
+        map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error{ "Cannot map file " + path };
+        }
+        madvise(map, len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    std::unique_ptr<mapped_stream> res{ new mapped_stream{ path, static_cast<const char *>(map), len } };
+    res->_map = map;
+    return res;
+}
+
+std::unique_ptr<mapped_stream> mapped_stream::load(const std::string &path) {
+    std::ifstream ifs{ path, std::ios::binary };
+    if (!ifs)
+        throw std::runtime_error{ "Cannot open file " + path };
+    return read(ifs, path);
+}
+
+std::unique_ptr<mapped_stream> mapped_stream::read(std::istream &is, std::string name) {
+    std::unique_ptr<mapped_stream> res{ new mapped_stream{ std::move(name), nullptr, 0 } };
+    auto &buf = res->_buffer;
+    constexpr size_t chunk = 64 * 1024;
+    while (is) {
+        auto sz = buf.size();
+        buf.resize(sz + chunk);
+        is.read(buf.data() + sz, chunk);
+        buf.resize(sz + is.gcount());
+    }
+    res->_data = buf.data();
+    res->_len = buf.size();
+    res->index_bytes();
+    return res;
+}
+
+mapped_stream::~mapped_stream() {
+    if (_map)
+        munmap(_map, _len);
+}
+
+static bool is_cont(char c) {
+    return (static_cast<unsigned char>(c) & 0xc0) == 0x80;
+}
+
+void mapped_stream::index_bytes() {
+    unsigned char acc{};
+    for (size_t i{}; i < _len; i++) // Vectorized by the compiler.
+        acc |= static_cast<unsigned char>(_data[i]);
+    _ascii = !(acc & 0x80);
+    if (_ascii) {
+        _n_cp = _len;
+        return;
+    }
+    for (size_t b{}; b < _len; b = next(b)) {
+        if (_n_cp % g_stride == 0)
+            _checkpoints.push_back(b);
+        _n_cp++;
+    }
+}
+
+// Every code point begins with a byte that is not a continuation byte,
+// except for garbage at the very beginning of the input.
+size_t mapped_stream::next(size_t byte) const {
+    if (_ascii) return byte + 1;
+    for (byte++; byte < _len && is_cont(_data[byte]); byte++);
+    return byte;
+}
+
+size_t mapped_stream::byte_of(size_t cp) const {
+    if (cp >= _n_cp) return _len;
+    if (_ascii) return cp;
+    auto b = _checkpoints[cp / g_stride];
+    for (auto n = cp % g_stride; n; n--)
+        b = next(b);
+    return b;
+}
+
+size_t mapped_stream::decode(size_t byte) const {
+    auto e = next(byte);
+    auto c = static_cast<unsigned char>(_data[byte]);
+    if (c < 0x80) return e == byte + 1 ? c : 0xfffd;
+    size_t len, cp;
+    if ((c & 0xe0) == 0xc0)
+        len = 2, cp = c & 0x1f;
+    else if ((c & 0xf0) == 0xe0)
+        len = 3, cp = c & 0x0f;
+    else if ((c & 0xf8) == 0xf0)
+        len = 4, cp = c & 0x07;
+    else
+        return 0xfffd;
+    if (e - byte != len) return 0xfffd;
+    for (auto i = byte + 1; i < e; i++)
+        cp = cp << 6 | (static_cast<unsigned char>(_data[i]) & 0x3f);
+    return cp;
+}
+
+void mapped_stream::consume() {
+    if (_cp >= _n_cp)
+        throw antlr4::IllegalStateException{ "cannot consume EOF" };
+    _cp++;
+    _byte = next(_byte);
+}
+
+size_t mapped_stream::LA(ssize_t i) {
+    if (i == 0) return 0; // undefined
+    if (i < 0) {
+        if (static_cast<size_t>(-i) > _cp) return EOF;
+        return decode(byte_of(_cp + i));
+    }
+    if (_cp + i > _n_cp) return EOF;
+    if (_ascii) return static_cast<unsigned char>(_data[_cp + i - 1]);
+    auto b = _byte;
+    for (; i > 1; i--)
+        b = next(b);
+    return decode(b);
+}
+
+void mapped_stream::seek(size_t index) {
+    index = std::min(index, _n_cp);
+    if (index == _cp) return;
+    // The lexer mostly seeks a few code points back or forth; walk if cheap.
+    if (index > _cp && index - _cp < g_stride) {
+        while (_cp < index)
+            consume();
+        return;
+    }
+    _cp = index;
+    _byte = byte_of(index);
+}
+
+std::string mapped_stream::getText(const antlr4::misc::Interval &interval) {
+    auto a = static_cast<size_t>(interval.a);
+    auto b = std::min(static_cast<size_t>(interval.b), _n_cp - 1);
+    if (interval.a < 0 || interval.b < 0 || a >= _n_cp || a > b)
+        return {};
+    auto s = byte_of(a);
+    return { _data + s, byte_of(b + 1) - s };
+}
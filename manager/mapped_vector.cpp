@@ -0,0 +1,95 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mapped_vector.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+using namespace parsing;
+
+static constexpr size_t g_initial = 64 * 1024;
+
+mapping::mapping(const std::string &dir) {
+    if (dir.empty()) return;
+    auto path = dir + "/ajnin.XXXXXX";
+    _fd = mkostemp(path.data(), O_CLOEXEC);
+    if (_fd == -1)
+        throw std::runtime_error{ "Cannot create file in " + dir };
+    unlink(path.c_str());
+}
+
+mapping::mapping(mapping &&o) noexcept
+        : _data{ std::exchange(o._data, nullptr) }, _size{ std::exchange(o._size, 0) },
+          _cap{ std::exchange(o._cap, 0) }, _fd{ std::exchange(o._fd, -1) } { }
+
+mapping &mapping::operator=(mapping &&o) noexcept {
+    std::swap(_data, o._data);
+    std::swap(_size, o._size);
+    std::swap(_cap, o._cap);
+    std::swap(_fd, o._fd);
+    return *this;
+}
+
+mapping::~mapping() {
+    if (_data)
+        munmap(_data, _cap);
+    if (_fd != -1)
+        close(_fd);
+}
+
+char *mapping::extend(size_t n) {
+    if (_size + n > _cap) {
+        auto cap = std::max(g_initial, _cap);
+        while (cap < _size + n)
+            cap *= 2;
+        if (spilled() && ftruncate(_fd, static_cast<off_t>(cap)) == -1)
+            throw std::runtime_error{ "Cannot grow spill file" };
+        void *p;
+        if (_data)
+            p = mremap(_data, _cap, cap, MREMAP_MAYMOVE);
+        else if (spilled())
+            p = mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        else
+            p = mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::runtime_error{ "Cannot map " + std::to_string(cap) + " bytes" };
+        _data = static_cast<char *>(p);
+        _cap = cap;
+    }
+    auto res = _data + _size;
+    _size += n;
+    return res;
+}
+
+// Dirty pages of a shared file mapping are not lost, only written back later.
+void mapping::release() const {
+    if (spilled() && _data)
+        madvise(_data, _cap, MADV_DONTNEED);
+}
+
+size_t mapping::resident() {
+    std::ifstream ifs{ "/proc/self/statm" };
+    size_t total{}, rss{};
+    ifs >> total >> rss;
+    return rss * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
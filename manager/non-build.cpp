@@ -17,15 +17,32 @@
 
 #include "manager.hpp"
 
+#include <algorithm>
 #include <boost/regex.hpp>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
-#include <stack>
+#include <spawn.h>
+#include <string_view>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include "TLexer.h"
+#include "mapped_stream.hpp"
+#include "parallel.hpp"
 
 using namespace parsing;
 using namespace std::string_literals;
 
+// include list files bigger than two of these are parsed in parallel.
+static constexpr size_t g_list_chunk = 4 << 20;
+
 antlrcpp::Any manager::visitDebugStmt(TParser::DebugStmtContext *ctx) {
     if (_quiet) return {};
 
@@ -102,6 +119,7 @@ antlrcpp::Any manager::visitRuleStmt(TParser::RuleStmtContext *ctx) {
         visitChildren(ctx);
         _current_rule = nullptr;
         _current_artifact.clear();
+        _current->resolved.clear();
         return {};
     }
 
@@ -112,70 +130,101 @@ antlrcpp::Any manager::visitRuleStmt(TParser::RuleStmtContext *ctx) {
         _current_rule = nullptr;
         _current_artifact.clear();
     }
+    _current->resolved.clear();
     return {};
 }
 
 antlrcpp::Any manager::visitForeachGroupStmt(TParser::ForeachGroupStmtContext *ctx) {
     ctx_guard next{ _current, ctx->stmts() != nullptr };
 
-    auto ids = ctx->ID();
+    // One per list, in order. Joined (by ~) to the previous one, a list only
+    // contributes the items whose key equals the key of the previous item,
+    // where the key is the name, or the n-th arg if written as a SubID.
+    // The body may change any list, so items are indexed by position and
+    // the hash of their key, and compared again when visited.
+    struct level_t {
+        C c;
+        int field;
+        bool join;
+        std::unordered_map<size_t, std::vector<size_t>> index;
+    };
+    std::vector<level_t> lvs;
+    auto join = false;
+    for (auto ch : ctx->children) {
+        auto t = dynamic_cast<antlr4::tree::TerminalNode *>(ch);
+        if (!t) continue;
+        auto type = t->getSymbol()->getType();
+        if (type == TParser::Tilde) {
+            join = true;
+        } else if (type == TParser::ID || type == TParser::SubID) {
+            auto id = t->getText();
+            lvs.push_back(level_t{ id[0], type == TParser::SubID ? id[1] - '0' : -1, join });
+            join = false;
+        }
+    }
+    auto key = [&](const list_item_t &it, int field) -> std::string_view {
+        if (field == -1) return it.name;
+        return field < it.args.size() ? it.args[field] : std::string_view{};
+    };
+    for (size_t k{}; k < lvs.size(); k++) {
+        auto &lv = lvs[k];
+        if (lv.field != -1 && !lv.join && !(k + 1 < lvs.size() && lvs[k + 1].join))
+            throw std::runtime_error{ "List "s + lv.c + " has a key but is not joined by ~" };
+        if (!lv.join) continue;
+        auto &items = _lists[lv.c].items;
+        for (size_t i{}; i < items.size(); i++)
+            lv.index[std::hash<std::string_view>{}(key(items[i], lv.field))].push_back(i);
+    }
 
     if (_debug) {
         std::cerr << std::string(_depth * 2, ' ') << "ajnin: Entering group of";
-        for (auto id : ids)
-            std::cerr << ' ' << as_id(id);
+        for (auto &lv : lvs)
+            std::cerr << ' ' << (lv.join ? "~" : "") << lv.c;
         std::cerr << '\n';
     }
     _depth++;
 
-    std::stack<size_t> ii;
-    ii.push(0);
-    while (true) {
-        auto c = as_id(ids[ii.size() - 1]);
-        auto &li = _lists[c];
-        if (li.items.empty()) return {};
-
-        if (ii.top() == li.items.size()) goto pop;
-
-        _current->ass[c] = &li.items[ii.top()];
-        if (ii.size() == ids.size()) {
+    auto visit = [&](auto &self, size_t k) -> void {
+        auto &lv = lvs[k];
+        auto &li = _lists[lv.c];
+        auto each = [&](size_t i) {
+            _current->assign(lv.c, &li.items[i]);
+            if (k + 1 < lvs.size()) {
+                self(self, k + 1);
+                return;
+            }
             if (_debug) {
                 std::cerr << std::string(_depth * 2, ' ') << "ajnin:";
-                for (auto id : ids)
-                    std::cerr << " $" << as_id(id) << "=" << _current->ass[as_id(id)]->name;
+                for (auto &l : lvs)
+                    std::cerr << " $" << l.c << "=" << (*_current)[l.c]->name;
                 std::cerr << '\n';
             }
             if (ctx->stmts())
                 ctx->stmts()->accept(this);
             else
                 ctx->fragmentStmts()->accept(this);
-            if (next) {
-                _current->zrule = rule_t{};
-                _current->rules.clear();
-                _current->ideps.clear();
-                _current->iideps.clear();
-            }
-            ii.top()++;
-        }
-
-        if (ii.top() == li.items.size()) {
-            pop:
-            ii.pop();
-            if (ii.empty())
-                break;
-            ii.top()++;
-            continue;
+            if (next)
+                _current->reset();
+        };
+        if (!lv.join) {
+            for (size_t i{}; i < li.items.size(); i++)
+                each(i);
+            return;
         }
-
-        if (ii.size() < ids.size())
-            ii.push(0);
-    }
+        S want{ key(*(*_current)[lvs[k - 1].c], lvs[k - 1].field) };
+        auto it = lv.index.find(std::hash<std::string_view>{}(want));
+        if (it != lv.index.end())
+            for (auto i : it->second)
+                if (i < li.items.size() && key(li.items[i], lv.field) == want)
+                    each(i);
+    };
+    visit(visit, 0);
 
     _depth--;
     if (_debug) {
         std::cerr << std::string(_depth * 2, ' ') << "ajnin: Exiting group of";
-        for (auto id : ids)
-            std::cerr << ' ' << as_id(id);
+        for (auto &lv : lvs)
+            std::cerr << ' ' << (lv.join ? "~" : "") << lv.c;
         std::cerr << '\n';
     }
 
@@ -204,8 +253,7 @@ antlrcpp::Any manager::visitCollectOperation(TParser::CollectOperationContext *c
             ass->accept(this);
     }
     _current_rule = nullptr;
-    for (auto &[k, v] : rule.vars)
-        _current->app->vars[k] = v;
+    _current->app->vars = _current->app->vars.merge(rule.vars);
     for (auto &dep : rule.ideps)
         _current->app->ideps.insert(dep);
     for (auto &dep : rule.iideps)
@@ -241,15 +289,11 @@ antlrcpp::Any manager::visitListGroupStmt(TParser::ListGroupStmtContext *ctx) {
     ctx_guard next{ _current, ctx->OpenCurlyPath() != nullptr };
     _depth++;
     for (auto &item : _current_list->items) {
-        _current->ass[c] = &item;
+        _current->assign(c, &item);
         for (auto &st : ctx->stmt())
             st->accept(this);
-        if (next) {
-            _current->zrule = rule_t{};
-            _current->rules.clear();
-            _current->ideps.clear();
-            _current->iideps.clear();
-        }
+        if (next)
+            _current->reset();
     }
     _depth--;
 
@@ -269,19 +313,16 @@ antlrcpp::Any manager::visitListStmt(TParser::ListStmtContext *ctx) {
     return {};
 }
 
-template <typename Iter, typename Func>
-Iter remove_duplicates(Iter begin, Iter end, Func &&eq) {
-    auto it = begin;
-    Iter next;
-    for (; it != end; it = next) {
-        next = std::next(it);
-        if (next == end)
-            break;
-        end = std::remove_if(next, end, [&]<typename T>(T &&v) {
-            return eq(*it, std::forward<T>(v));
-        });
-    }
-    return end;
+// Drop items[i] unless keep[i], preserving order.
+static void keep_items(std::deque<list_item_t> &items, const std::vector<char> &keep) {
+    size_t k{};
+    for (size_t i{}; i < items.size(); i++)
+        if (keep[i]) {
+            if (k != i)
+                items[k] = std::move(items[i]);
+            k++;
+        }
+    items.resize(k);
 }
 
 antlrcpp::Any manager::visitListModifyStmt(TParser::ListModifyStmtContext *ctx) {
@@ -299,9 +340,46 @@ antlrcpp::Any manager::visitListModifyStmt(TParser::ListModifyStmtContext *ctx)
         std::stable_sort(it.begin(), it.end(), cmp);
         if (ctx->KUnique())
             it.erase(std::unique(it.begin(), it.end(), eq), it.end());
-    } else if (ctx->KUnique()) {
-        it.erase(remove_duplicates(it.begin(), it.end(), eq), it.end());
+        return {};
+    }
+
+    std::vector<char> keep(it.size());
+    std::unordered_set<std::string_view> names;
+    if (ctx->KUnique()) {
+        for (size_t i{}; i < it.size(); i++)
+            keep[i] = names.insert(it[i].name).second;
+        keep_items(it, keep);
+        return {};
+    }
+
+    auto op = ctx->Token()->getText();
+    if (op != "union" && op != "intersect" && op != "except")
+        throw std::runtime_error{ "Unknown list operation " + op };
+    auto c = as_id(ctx->ID());
+    auto o = _lists.find(c);
+    if (o == _lists.end())
+        throw std::runtime_error{ "List "s + c + " does not exist" };
+    auto &other = o->second.items;
+    if (&other == &it) { // Nothing to do but except.
+        if (op == "except")
+            it.clear();
+        return {};
+    }
+    if (op == "union") {
+        for (auto &item : it)
+            names.insert(item.name);
+        // Elements of a deque stay in place as it grows.
+        for (auto &item : other)
+            if (names.insert(item.name).second)
+                it.push_back(item);
+        return {};
     }
+    for (auto &item : other)
+        names.insert(item.name);
+    auto want = op == "intersect";
+    for (size_t i{}; i < it.size(); i++)
+        keep[i] = names.contains(it[i].name) == want;
+    keep_items(it, keep);
     return {};
 }
 
@@ -320,43 +398,165 @@ antlrcpp::Any manager::visitIncludeStmt(TParser::IncludeStmtContext *ctx) {
 
     auto [s, flag] = expand(s0);
     if (flag) throw std::runtime_error{ "Glob not allowed in " + s0 };
+    // Commands included, see collect_deps.
     _ajnin_deps.insert(s);
+    await_executes();
+
+    list_reader_t rd{ _current_list->items };
+    if (s.starts_with('!')) {
+        auto shell = s.starts_with("!!");
+        read_list_command(rd, s.substr(shell ? 2 : 1), shell);
+    } else {
+        read_list_file(rd, s);
+    }
+
+    _depth--;
+    _current_list = nullptr;
+    return {};
+}
 
-    {
-        std::ifstream fin{ s };
-        list_item_t item;
-        auto empty = true;
+void manager::read_list_line(list_reader_t &rd, std::string_view line) {
+    if (line.starts_with('#'))
+        return;
+    S expanded;
+    if (line.find('$') != std::string_view::npos) {
+        expanded = expand_env(S{ line });
+        line = expanded;
+    }
+    if (!line.ends_with(" \\")) {
+        if (rd.empty) {
+            rd.items.emplace_back(list_item_t{ S{ line } });
+            return;
+        }
+        rd.item.args.emplace_back(line);
+        rd.items.emplace_back(std::move(rd.item));
+        rd.item = list_item_t{};
+        rd.empty = true;
+    } else {
+        line.remove_suffix(2);
+        if (rd.empty) {
+            rd.item.name = line;
+            rd.empty = false;
+            return;
+        }
+        rd.item.args.emplace_back(line);
+    }
+}
+
+// Call f on each line of text, every one of which ends with '\n'.
+template <typename F>
+static void for_each_line(std::string_view text, const F &f) {
+    for (auto p = text.data(), end = p + text.size(); p != end;) {
+        auto nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        f(std::string_view{ p, static_cast<size_t>(nl - p) });
+        p = nl + 1;
+    }
+}
+
+void manager::read_list_file(list_reader_t &rd, const S &path) {
+    if (!std::filesystem::is_regular_file(path)) { // Pipes and the like cannot be mapped.
+        std::ifstream fin{ path };
         while (!fin.eof()) {
             S line;
             std::getline(fin, line);
             if (!fin.good()) break;
-            if (line.starts_with("#"))
-                continue;
-            line = expand_env(line);
-            if (!line.ends_with(" \\")) {
-                if (empty) {
-                    _current_list->items.emplace_back(list_item_t{ line });
-                    continue;
-                }
-                item.args.emplace_back(line);
-                _current_list->items.emplace_back(std::move(item));
-                item = list_item_t{};
-                empty = true;
-            } else {
-                line = line.substr(0, line.size() - 2);
-                if (empty) {
-                    item.name = line;
-                    empty = false;
-                    continue;
-                }
-                item.args.emplace_back(line);
-            }
+            read_list_line(rd, line);
         }
+        return;
     }
 
-    _depth--;
-    _current_list = nullptr;
-    return {};
+    auto ms = mapped_stream::open(path); // Nothing runs until it is consumed.
+    auto text = ms->bytes();
+    text = text.substr(0, text.rfind('\n') + 1); // Like getline, drop an unterminated last line.
+    auto line = [&](std::string_view l) { read_list_line(rd, l); };
+    // Only then read_list_line leaves everything but its own items alone.
+    if (text.size() < 2 * g_list_chunk || text.find('$') != std::string_view::npos) {
+        for_each_line(text, line);
+        return;
+    }
+
+    // Cut after lines that end an item, so every chunk starts afresh.
+    std::vector<size_t> cuts{ 0 };
+    for (auto pos = g_list_chunk; pos < text.size();) {
+        auto nl = text.find('\n', pos);
+        auto bol = text.rfind('\n', nl - 1) + 1;
+        auto l = text.substr(bol, nl - bol);
+        pos = nl + 1;
+        if (l.starts_with('#') || l.ends_with(" \\"))
+            continue;
+        if (pos < text.size())
+            cuts.push_back(pos);
+        pos = std::max(pos, cuts.back() + g_list_chunk);
+    }
+    cuts.push_back(text.size());
+
+    std::vector<std::deque<list_item_t>> parts(cuts.size() - 1);
+    parallel_for(parts.size(), [&](size_t b, size_t e) {
+        for (auto i = b; i < e; i++) {
+            list_reader_t r{ parts[i] };
+            for_each_line(text.substr(cuts[i], cuts[i + 1] - cuts[i]),
+                          [&](std::string_view l) { read_list_line(r, l); });
+        }
+    }, 1);
+    for (auto &p : parts)
+        rd.items.insert(rd.items.end(), std::make_move_iterator(p.begin()), std::make_move_iterator(p.end()));
+}
+
+void manager::read_list_command(list_reader_t &rd, const S &cmd, bool shell) {
+    SS args;
+    if (shell) {
+        args = { "sh", "-c", cmd };
+    } else {
+        for (size_t i{}, j; i < cmd.size(); i = j) {
+            i = cmd.find_first_not_of(" \t", i);
+            if (i == S::npos) break;
+            j = std::min(cmd.find_first_of(" \t", i), cmd.size());
+            args.emplace_back(cmd.substr(i, j - i));
+        }
+        if (args.empty()) throw std::runtime_error{ "Empty command in include list" };
+    }
+    std::vector<char *> argv;
+    for (auto &a : args)
+        argv.push_back(a.data());
+    argv.push_back(nullptr);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        throw std::runtime_error{ "Cannot make a pipe for " + cmd };
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+    int pid;
+    auto err = shell
+            ? posix_spawn(&pid, "/bin/sh", &fa, nullptr, argv.data(), environ)
+            : posix_spawnp(&pid, argv[0], &fa, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(fds[1]);
+    if (err) {
+        close(fds[0]);
+        throw std::runtime_error{ "Cannot spawn " + cmd };
+    }
+
+    // Lines are handed over as soon as they are complete; like getline,
+    // an unterminated last line is dropped.
+    S buf;
+    char chunk[64 * 1024];
+    while (true) {
+        auto n = read(fds[0], chunk, sizeof(chunk));
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf.append(chunk, n);
+        size_t b{};
+        for (size_t e; (e = buf.find('\n', b)) != S::npos; b = e + 1)
+            read_list_line(rd, std::string_view{ buf }.substr(b, e - b));
+        buf.erase(0, b);
+    }
+    close(fds[0]);
+
+    int status{ -1 };
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    if (status != 0)
+        throw std::runtime_error{ "List command " + cmd + " failed with " + std::to_string(status) };
 }
 
 antlrcpp::Any manager::visitListSearchStmt(TParser::ListSearchStmtContext *ctx) {
@@ -368,6 +568,24 @@ antlrcpp::Any manager::visitListSearchStmt(TParser::ListSearchStmtContext *ctx)
     return {};
 }
 
+antlrcpp::Any manager::visitListEnumStmt(TParser::ListEnumStmtContext *ctx) {
+    visitChildren(ctx);
+    flush_removals();
+    return {};
+}
+
+// -= is deferred until a removed name is added back or the statement ends,
+// so that many of them cost a single pass.
+void manager::flush_removals() {
+    if (_removals.empty()) return;
+    auto &it = _current_list->items;
+    std::vector<char> keep(it.size());
+    for (size_t i{}; i < it.size(); i++)
+        keep[i] = !_removals.contains(it[i].name);
+    keep_items(it, keep);
+    _removals.clear();
+}
+
 antlrcpp::Any manager::visitListEnumStmtItem(TParser::ListEnumStmtItemContext *ctx) {
     list_item_t item;
     auto flag = false;
@@ -379,13 +597,13 @@ antlrcpp::Any manager::visitListEnumStmtItem(TParser::ListEnumStmtItemContext *c
         else
             item.args.emplace_back(std::move(st));
     }
-    auto &s = _current_list->items;
-    if (ctx->ListEnumItem())
-        s.emplace_back(std::move(item));
-    else if (ctx->ListEnumRItem())
-        s.erase(std::remove_if(s.begin(), s.end(), [&](const list_item_t &it) {
-            return it.name == item.name;
-        }), s.end());
+    if (ctx->ListEnumItem()) {
+        if (_removals.contains(item.name))
+            flush_removals();
+        _current_list->items.emplace_back(std::move(item));
+    } else if (ctx->ListEnumRItem()) {
+        _removals.insert(std::move(item.name));
+    }
     return {};
 }
 
@@ -418,7 +636,10 @@ antlrcpp::Any manager::visitTemplateStmt(TParser::TemplateStmtContext *ctx) {
     _current_template = nullptr;
 
     tmp.builds = std::move(_builds);
-    _templates[tmp.name] += std::move(tmp);
+    auto &t = _templates[tmp.name];
+    t += std::move(tmp);
+    t.compile();
+    _memo.clear();
     _builds = std::move(prev_builds);
     return {};
 }
@@ -430,22 +651,139 @@ antlrcpp::Any manager::visitExecuteStmt(TParser::ExecuteStmtContext *ctx) {
 
     auto [st, glob] = expand(s0);
     if (glob) throw std::runtime_error{ "Glob not allow in " + s0 };
+
+    // Only execute * runs alongside others; anything else may depend on them.
+    auto async = ctx->Times() != nullptr;
+    if (!async)
+        await_executes();
+
+    auto inputs = std::move(_exec_inputs);
+    _exec_inputs.clear();
+    S key;
+    // Without inputs, nothing would ever tell that its outputs are gone.
+    if (!_eval.exec_cache.empty() && !inputs.empty()) {
+        if (!_exec_cache) {
+            _exec_cache.emplace();
+            std::ifstream ifs{ _eval.exec_cache };
+            for (S line; std::getline(ifs, line);)
+                _exec_cache->insert(line.substr(0, line.find(' ')));
+        }
+        key = exec_key(st, inputs);
+        if (!key.empty() && _exec_cache->contains(key)) {
+            if (_debug)
+                std::cerr << std::string(_depth * 2, ' ') << "ajnin: Skipping external command " << st
+                          << " as its inputs did not change\n";
+            _exec_hits.emplace(std::move(key), st);
+            return {};
+        }
+    }
+
     if (_debug)
         std::cerr << std::string(_depth * 2, ' ') << "ajnin: Executing external command " << st << '\n';
 
+    // The command may well (re)generate files we are about to include.
+    if (_prefetch)
+        _prefetch->invalidate();
+    if (async) {
+        char sh[] = "sh", c[] = "-c";
+        char *const argv[]{ sh, c, st.data(), nullptr };
+        int pid;
+        if (posix_spawn(&pid, "/bin/sh", nullptr, nullptr, argv, environ))
+            throw std::runtime_error{ "Cannot spawn external command " + st };
+        _jobs.push_back(job_t{ st, std::move(key), pid });
+        return {};
+    }
     auto ret = system(st.c_str());
     if (ret != 0)
         throw std::runtime_error{ "External command " + st + " failed with " + std::to_string(ret) };
+    if (!key.empty())
+        _exec_hits.emplace(std::move(key), st);
 
     return {};
 }
 
+S manager::exec_key(const S &cmd, const SS &inputs) const {
+    auto str = cmd;
+    for (auto &in : inputs) {
+        struct stat st{};
+        if (stat(in.c_str(), &st) == -1)
+            return {};
+        str += '\0' + in + '\0' + std::to_string(st.st_size) + '\0' + std::to_string(st.st_mtim.tv_sec)
+               + '.' + std::to_string(st.st_mtim.tv_nsec);
+    }
+    uint64_t h{ 14695981039346656037ull }; // FNV-1a
+    for (auto ch : str)
+        h = (h ^ static_cast<unsigned char>(ch)) * 1099511628211ull;
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+    return buf;
+}
+
+void manager::await_executes() {
+    if (_jobs.empty()) return;
+
+    S failed;
+    int code{};
+    for (auto &j : _jobs) {
+        int status{ -1 };
+        while (waitpid(j.pid, &status, 0) == -1 && errno == EINTR);
+        if (status != 0) {
+            if (failed.empty())
+                failed = j.cmd, code = status;
+        } else if (!j.key.empty()) {
+            _exec_hits.emplace(std::move(j.key), j.cmd);
+        }
+    }
+    _jobs.clear();
+    // Files read ahead may have been (re)generated meanwhile.
+    if (_prefetch)
+        _prefetch->invalidate();
+    if (!failed.empty())
+        throw std::runtime_error{ "External command " + failed + " failed with " + std::to_string(code) };
+}
+
+void manager::save_exec_cache() const {
+    if (!_exec_cache) return;
+    std::ofstream ofs{ _eval.exec_cache };
+    for (auto &[key, cmd] : _exec_hits)
+        ofs << key << ' ' << cmd << '\n';
+}
+
+// What every match of re starts with; may be shorter than it could be.
+static S literal_prefix(const S &re) {
+    for (size_t i{}; i < re.size(); i++)
+        if (re[i] == '\\')
+            i++;
+        else if (re[i] == '|')
+            return {};
+
+    S res;
+    for (size_t i{}; i < re.size(); i++) {
+        auto c = re[i];
+        auto len = 1;
+        if (c == '\\') {
+            if (i + 1 == re.size() || std::isalnum(static_cast<unsigned char>(re[i + 1])))
+                break;
+            c = re[i + 1], len = 2;
+        } else if (std::strchr(".[]{}()*+?^$", c)) {
+            break;
+        }
+        if (i + len < re.size() && std::strchr("*?{", re[i + len]))
+            break; // May not be there at all.
+        res += c;
+        i += len - 1;
+    }
+    return res;
+}
+
 antlrcpp::Any manager::visitPoolStmt(TParser::PoolStmtContext *ctx) {
     auto pool = ctx->Token()->getText();
 
     for (auto st : ctx->stage()) {
         st->accept(this);
         _pools[_current_artifact] = pool;
+        if (_eval.lazy_pools)
+            _pool_stamps[_current_artifact] = _pool_rules.size();
     }
 
     if (ctx->Path()) {
@@ -454,9 +792,16 @@ antlrcpp::Any manager::visitPoolStmt(TParser::PoolStmtContext *ctx) {
         s0.pop_back();
 
         boost::regex re{ s0 };
-        for (auto &[art, pb] : _builds)
+        auto prefix = literal_prefix(s0);
+        if (_eval.lazy_pools) { // See resolve_pools.
+            _pool_rules.push_back(pool_rule_t{ std::move(prefix), std::move(re), pool });
+            return {};
+        }
+        // Arts are sorted, so only those starting with the prefix are tried.
+        for_each_art(prefix, [&](const S &art) {
             if (boost::regex_match(art, re))
                 _pools[art] = pool;
+        });
     }
 
     return {};
@@ -0,0 +1,261 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler.hpp"
+#include "manager.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <malloc.h>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+using namespace parsing;
+
+namespace {
+    // Site 0 collects everything outside of any scope;
+    // the last site collects everything that does not fit.
+    constexpr size_t g_max_sites = 1 << 16;
+
+    struct site_t {
+        std::atomic<size_t> bytes, blocks;
+    };
+
+    site_t g_sites[g_max_sites];
+    std::atomic<bool> g_enabled;
+    std::atomic<ssize_t> g_live, g_peak;
+    std::atomic<size_t> g_peak_site;
+    thread_local size_t t_site;
+
+    std::mutex g_names_mtx;
+
+    std::vector<S> &names() {
+        static std::vector<S> n{ "(outside of any statement)" };
+        return n;
+    }
+
+    size_t intern(const S &site) {
+        static std::unordered_map<S, size_t> ids;
+        std::lock_guard lock{ g_names_mtx };
+        if (auto it = ids.find(site); it != ids.end())
+            return it->second;
+        auto &n = names();
+        if (n.size() == g_max_sites - 1)
+            n.emplace_back("(other sites)");
+        if (n.size() == g_max_sites)
+            return g_max_sites - 1;
+        n.emplace_back(site);
+        return ids[site] = n.size() - 1;
+    }
+
+    void on_alloc(void *p) {
+        if (!p || !g_enabled.load(std::memory_order_relaxed)) return;
+        auto sz = malloc_usable_size(p);
+        auto site = t_site;
+        g_sites[site].bytes.fetch_add(sz, std::memory_order_relaxed);
+        g_sites[site].blocks.fetch_add(1, std::memory_order_relaxed);
+        auto live = g_live.fetch_add(static_cast<ssize_t>(sz), std::memory_order_relaxed) + static_cast<ssize_t>(sz);
+        auto peak = g_peak.load(std::memory_order_relaxed);
+        while (live > peak)
+            if (g_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+                g_peak_site.store(site, std::memory_order_relaxed);
+                break;
+            }
+    }
+
+    void on_free(void *p) {
+        if (!p || !g_enabled.load(std::memory_order_relaxed)) return;
+        g_live.fetch_sub(static_cast<ssize_t>(malloc_usable_size(p)), std::memory_order_relaxed);
+    }
+
+    void *do_alloc(std::size_t sz) {
+        auto p = std::malloc(sz ? sz : 1);
+        on_alloc(p);
+        return p;
+    }
+
+    void do_free(void *p) {
+        on_free(p);
+        std::free(p);
+    }
+}
+
+void *operator new(std::size_t sz) {
+    if (auto p = do_alloc(sz)) return p;
+    throw std::bad_alloc{};
+}
+
+void *operator new[](std::size_t sz) {
+    if (auto p = do_alloc(sz)) return p;
+    throw std::bad_alloc{};
+}
+
+void *operator new(std::size_t sz, const std::nothrow_t &) noexcept { return do_alloc(sz); }
+void *operator new[](std::size_t sz, const std::nothrow_t &) noexcept { return do_alloc(sz); }
+void operator delete(void *p) noexcept { do_free(p); }
+void operator delete[](void *p) noexcept { do_free(p); }
+void operator delete(void *p, std::size_t) noexcept { do_free(p); }
+void operator delete[](void *p, std::size_t) noexcept { do_free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { do_free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { do_free(p); }
+
+void profiler::enable() {
+    g_enabled = true;
+}
+
+bool profiler::enabled() {
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+profiler::scope::scope(const S &site) : _prev{ t_site } {
+    t_site = intern(site);
+}
+
+profiler::scope::~scope() {
+    t_site = _prev;
+}
+
+void profiler::report(std::ostream &os, size_t limit) {
+    std::vector<std::pair<size_t, size_t>> order; // bytes, site
+    size_t total{}, blocks{};
+    for (size_t i{}; i < g_max_sites; i++) {
+        auto b = g_sites[i].bytes.load();
+        if (!b) continue;
+        total += b;
+        blocks += g_sites[i].blocks.load();
+        order.emplace_back(b, i);
+    }
+    std::sort(order.begin(), order.end(), std::greater{});
+    if (order.size() > limit)
+        order.resize(limit);
+
+    std::lock_guard lock{ g_names_mtx };
+    auto &n = names();
+    os << "ajnin: Allocated " << total << " bytes in " << blocks << " blocks\n";
+    os << "ajnin: Peak live memory is " << g_peak.load() << " bytes, reached in "
+       << n[g_peak_site.load()] << "\n";
+    os << "ajnin: Top " << order.size() << " allocation sites:\n";
+    for (auto &[b, i] : order)
+        os << "ajnin: " << std::setw(14) << b << " bytes " << std::setw(10) << g_sites[i].blocks.load()
+           << " blocks  " << n[i] << "\n";
+}
+
+// Estimated heap footprint of the long-lived structures, assuming libstdc++.
+namespace {
+    constexpr size_t g_node = 4 * sizeof(void *); // _Rb_tree_node_base
+    constexpr size_t g_ctrl = 2 * sizeof(void *); // make_shared control block
+
+    size_t footprint(const S &s);
+    size_t footprint(const list_item_t &it);
+    size_t footprint(const build_t &b);
+    size_t footprint(const pbuild_t &pb);
+
+    template <typename T>
+    size_t footprint(const std::deque<T> &d) {
+        constexpr size_t chunk = sizeof(T) < 512 ? 512 / sizeof(T) * sizeof(T) : sizeof(T);
+        auto sz = (d.size() * sizeof(T) / chunk + 1) * chunk + 8 * sizeof(void *);
+        for (auto &v : d)
+            sz += footprint(v);
+        return sz;
+    }
+
+    template <typename T, size_t N>
+    size_t footprint(const boost::container::small_vector<T, N> &v) {
+        auto sz = v.capacity() > N ? v.capacity() * sizeof(T) : 0;
+        for (auto &e : v)
+            sz += footprint(e);
+        return sz;
+    }
+
+    template <typename T>
+    size_t footprint(const std::set<T> &s) {
+        auto sz = s.size() * (g_node + sizeof(T));
+        for (auto &v : s)
+            sz += footprint(v);
+        return sz;
+    }
+
+    template <typename K, typename V>
+    size_t footprint(const std::map<K, V> &m) {
+        auto sz = m.size() * (g_node + sizeof(std::pair<const K, V>));
+        for (auto &[k, v] : m)
+            sz += footprint(k) + footprint(v);
+        return sz;
+    }
+
+    size_t footprint(const S &s) {
+        return s.capacity() > S{}.capacity() ? s.capacity() + 1 : 0;
+    }
+
+    size_t footprint(const list_item_t &it) {
+        return footprint(it.name) + footprint(it.args);
+    }
+
+    size_t footprint(const build_t &b) {
+        return footprint(b.art) + footprint(b.rule) + footprint(b.deps)
+               + footprint(b.ideps) + footprint(b.iideps); // vars are shared, see report().
+    }
+
+    size_t footprint(const pbuild_t &pb) {
+        if (!pb) return 0;
+        return g_ctrl + sizeof(build_t) + footprint(*pb);
+    }
+}
+
+void manager::report(std::ostream &os) const {
+    size_t lists{}, items{};
+    for (auto &[c, l] : _lists) {
+        lists += g_node + sizeof(std::pair<const C, list_t>) + footprint(l.items);
+        items += l.items.size();
+    }
+
+    size_t templates{}, tbuilds{};
+    for (auto &[k, t] : _templates) {
+        templates += g_node + sizeof(std::pair<const S, template_t>) + footprint(k) + footprint(t.name);
+        templates += footprint(t.builds) + footprint(t.arts);
+        templates += t.nexts.size() * sizeof(template_t::next_t);
+        for (auto &n : t.nexts)
+            templates += footprint(n.art) + footprint(n.name) + footprint(n.args);
+        tbuilds += t.builds.size();
+    }
+
+    size_t vars{}, nvars{};
+    vars_t::visit([&](const vars_t::map_t &m) {
+        vars += g_ctrl + sizeof(vars_t::map_t) + sizeof(size_t) + footprint(m);
+        nvars++;
+    });
+
+    os << "ajnin: Estimated footprint of _builds is " << footprint(_builds)
+       << " bytes for " << _builds.size() << " builds\n";
+    if (_frozen)
+        os << "ajnin: Estimated footprint of _graph is " << _graph.footprint()
+           << " bytes for " << _graph.size() << " builds\n";
+    os << "ajnin: Estimated footprint of var sets is " << vars
+       << " bytes for " << nvars << " distinct sets\n";
+    os << "ajnin: Estimated footprint of _lists is " << lists
+       << " bytes for " << items << " items in " << _lists.size() << " lists\n";
+    os << "ajnin: Estimated footprint of _templates is " << templates
+       << " bytes for " << tbuilds << " builds in " << _templates.size() << " templates\n";
+    os << "ajnin: Lexed " << _tokens_total << " tokens; largest token stream held " << _tokens_peak
+       << " tokens, about " << _tokens_peak * (sizeof(antlr4::CommonToken) + sizeof(void *)) << " bytes\n";
+
+    profiler::report(os, _debug_limit);
+}
@@ -0,0 +1,1052 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rd_parser.hpp"
+
+#include <algorithm>
+#include <vector>
+#include "TLexer.h"
+
+using namespace parsing;
+using namespace std::string_literals;
+
+static const std::pair<std::string_view, size_t> g_keywords[]{
+        { "list", TLexer::KList },
+        { "rule", TLexer::KRule },
+        { "foreach", TLexer::KForeach },
+        { "include", TLexer::KInclude },
+        { "if", TLexer::KIf },
+        { "else", TLexer::KElse },
+        { "also", TLexer::KAlso },
+        { "sort", TLexer::KSort },
+        { "uniq", TLexer::KUnique },
+        { "desc", TLexer::KDesc },
+        { "print", TLexer::KPrint },
+        { "clear", TLexer::KClear },
+        { "file", TLexer::KFile },
+        { "template", TLexer::KTemplate },
+        { "execute", TLexer::KExecute },
+        { "meta", TLexer::KMeta },
+        { "pool", TLexer::KPool },
+        { "default", TLexer::KDefault },
+};
+
+// fragment LETTER : [a-zA-Z\u0080-\u{10FFFF}];
+// Every byte of a multi-byte UTF-8 sequence is >= 0x80.
+static bool is_letter(int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static bool is_digit(int c) {
+    return c >= '0' && c <= '9';
+}
+
+int rd_lexer::peek(size_t k) const {
+    if (_pos + k >= _src.size()) return -1;
+    return static_cast<unsigned char>(_src[_pos + k]);
+}
+
+// Positions are counted in code points, just like ANTLRInputStream does.
+void rd_lexer::advance(size_t n) {
+    for (; n; n--, _pos++) {
+        auto c = static_cast<unsigned char>(_src[_pos]);
+        if ((c & 0xc0) == 0x80) continue;
+        _cp++;
+        if (c == '\n')
+            _line++, _col = 0;
+        else
+            _col++;
+    }
+}
+
+void rd_lexer::begin() {
+    _start_pos = _pos, _start_cp = _cp, _start_line = _line, _start_col = _col;
+}
+
+std::unique_ptr<antlr4::CommonToken> rd_lexer::emit(size_t type) {
+    auto tok = std::make_unique<antlr4::CommonToken>(std::make_pair(nullptr, _is), type,
+            antlr4::Token::DEFAULT_CHANNEL, _start_cp, _cp - 1);
+    tok->setLine(_start_line);
+    tok->setCharPositionInLine(_start_col);
+    if (type == antlr4::Token::EOF)
+        tok->setText("<EOF>");
+    else
+        tok->setText(std::string{ _src.substr(_start_pos, _pos - _start_pos) });
+    return tok;
+}
+
+void rd_lexer::fail() const {
+    auto c = _pos < _src.size() ? std::string(1, _src[_pos]) : "<EOF>"s;
+    throw rd_error{ _line, _col, true, "token recognition error at: '" + c + "'" };
+}
+
+// NL1: '\r'? '\n';
+bool rd_lexer::newline(size_t k) const {
+    return peek(k) == '\n' || (peek(k) == '\r' && peek(k + 1) == '\n');
+}
+
+// LETTER ((LETTER | '0'..'9' | '_' | '-' | '.')* (LETTER | '0'..'9'))?
+// Returns the length of the longest match starting at k, which must be a LETTER.
+size_t rd_lexer::word(size_t k) const {
+    auto last = k + 1;
+    for (auto i = k + 1;; i++) {
+        auto c = peek(i);
+        if (is_letter(c) || is_digit(c))
+            last = i + 1;
+        else if (c != '_' && c != '-' && c != '.')
+            break;
+    }
+    return last - k;
+}
+
+std::unique_ptr<antlr4::CommonToken> rd_lexer::next() {
+    while (true) {
+        switch (_mode) {
+            case PRE_PATH:
+                while (peek() == ' ' || peek() == '\t')
+                    advance();
+                begin();
+                if (peek() == -1) return emit(antlr4::Token::EOF);
+                advance(); // PrePathText: . -> more, mode(path);
+                while (true) {
+                    if (peek() == -1) fail();
+                    if (newline(0)) {
+                        advance(peek() == '\r' ? 2 : 1);
+                        _mode = DEFAULT_MODE;
+                        return emit(TLexer::Path);
+                    }
+                    if (peek() == ' ' && peek(1) == '{' && newline(2)) {
+                        advance(peek(2) == '\r' ? 4 : 3);
+                        _mode = DEFAULT_MODE;
+                        return emit(TLexer::OpenCurlyPath);
+                    }
+                    if (peek() == ' ' && peek(1) == '{' && peek(2) == '{' && newline(3)) {
+                        advance(peek(3) == '\r' ? 5 : 4);
+                        _mode = DEFAULT_MODE;
+                        return emit(TLexer::OpenDoubleCurlyPath);
+                    }
+                    advance();
+                }
+
+            case LIST_ITEM:
+                while (peek() == ' ' || peek() == '\t')
+                    advance();
+                begin();
+                if (peek() == -1) return emit(antlr4::Token::EOF);
+                if (newline(0)) {
+                    advance(peek() == '\r' ? 2 : 1);
+                    _mode = DEFAULT_MODE;
+                    return emit(TLexer::ListItemNL);
+                }
+                if (peek() == '\r') fail();
+                while (peek() != -1 && peek() != ' ' && peek() != '\t' && peek() != '\r' && peek() != '\n')
+                    advance();
+                return emit(TLexer::ListItemToken);
+
+            case LITERAL:
+                begin();
+                while (!newline(0)) {
+                    if (peek() == -1) fail();
+                    advance();
+                }
+                advance(peek() == '\r' ? 2 : 1);
+                _mode = DEFAULT_MODE;
+                return emit(TLexer::LiteralNL);
+
+            case DEFAULT_MODE:
+                break;
+        }
+
+        begin();
+        auto c = peek();
+        auto tok = [&](size_t len, size_t type, mode_t mode = DEFAULT_MODE) {
+            advance(len);
+            _mode = mode;
+            return emit(type);
+        };
+        switch (c) {
+            case -1:
+                return emit(antlr4::Token::EOF);
+            case ' ':
+            case '\t':
+                while (peek() == ' ' || peek() == '\t')
+                    advance();
+                continue;
+            case '\\':
+                if (!newline(1)) fail();
+                advance(peek(1) == '\r' ? 3 : 2);
+                continue;
+            case '\r':
+            case '\n':
+                if (!newline(0)) fail();
+                return tok(c == '\r' ? 2 : 1, TLexer::NL1);
+            case '#':
+                while (peek() != -1 && peek() != '\r' && peek() != '\n')
+                    advance();
+                if (!newline(0)) fail();
+                advance(peek() == '\r' ? 2 : 1);
+                continue;
+            case '>':
+                if (peek(1) == '>') return tok(2, TLexer::Mult);
+                if (peek(1) == ' ') return tok(2, TLexer::LiteralProlog, LITERAL);
+                if (newline(1)) return tok(peek(1) == '\r' ? 3 : 2, TLexer::LiteralEmptyText);
+                fail();
+            case '<':
+                if (peek(1) == '<') return tok(2, TLexer::Append);
+                if (is_letter(peek(1))) {
+                    auto len = word(1);
+                    if (peek(1 + len) == '>') return tok(len + 2, TLexer::TemplateName);
+                }
+                fail();
+            case ':':
+                if (peek(1) == ':' && peek(2) == '=') return tok(3, TLexer::ListEnum, LIST_ITEM);
+                if (peek(1) == '=') return tok(2, TLexer::ListSearch, PRE_PATH);
+                fail();
+            case '+':
+                if (peek(1) == '=') return tok(2, TLexer::ListEnumItem, LIST_ITEM);
+                fail();
+            case '-':
+                if (peek(1) == '=') return tok(2, TLexer::ListEnumRItem, LIST_ITEM);
+                if (peek(1) == '-') return tok(2, TLexer::Single);
+                if (peek(1) == 'z') return tok(2, TLexer::IsEmpty);
+                if (peek(1) == 'n') return tok(2, TLexer::IsNonEmpty);
+                fail();
+            case '|':
+                if (peek(1) == '|' && peek(2) == '=') return tok(3, TLexer::RuleAppend2);
+                if (peek(1) == '=') return tok(2, TLexer::RuleAppend);
+                fail();
+            case '*':
+                return tok(1, TLexer::Times);
+            case '!':
+                return tok(1, TLexer::Exclamation);
+            case '{':
+                if (peek(1) == '{') return tok(2, TLexer::OpenDoubleCurly);
+                return tok(1, TLexer::OpenCurly);
+            case '}':
+                if (peek(1) == '}') return tok(2, TLexer::CloseDoubleCurly);
+                return tok(1, TLexer::CloseCurly);
+            case '[':
+                return tok(1, TLexer::Bra);
+            case ']':
+                return tok(1, TLexer::Ket);
+            case '~':
+                return tok(1, TLexer::Tilde);
+            case '$':
+                return tok(1, TLexer::Dollar);
+            case '(': { // OpenPar: '(' -> more, mode(stage);
+                size_t i = 1;
+                for (; peek(i) != ')'; i++)
+                    if (peek(i) == -1) fail();
+                return tok(i + 1, TLexer::Stage);
+            }
+            case '&': { // Ampersand: '&' -> more, mode(assign);
+                size_t i = 1;
+                for (; peek(i) != '+' && peek(i) != '='; i++)
+                    if (peek(i) == -1) fail();
+                if (peek(i) == '+' && peek(++i) != '=') fail();
+                return tok(i + 1, TLexer::Assign);
+            }
+            case '\'':
+            case '"': { // '\'' (~'\'' | '$\'')* '\''
+                // Longest match: a quote preceded by $ may either close or continue.
+                size_t len{};
+                for (size_t i = 1; peek(i) != -1; i++) {
+                    if (peek(i) != c) continue;
+                    len = i + 1;
+                    if (peek(i - 1) != '$') break;
+                }
+                if (!len) fail();
+                return tok(len, c == '\'' ? TLexer::SingleString : TLexer::DoubleString);
+            }
+            default:
+                break;
+        }
+        if (!is_letter(c)) fail();
+
+        auto len = word(0);
+        auto text = _src.substr(_pos, len);
+        if (len == 1 && c < 0x80) return tok(1, TLexer::ID);
+        if (len == 2 && c < 0x80 && is_digit(peek(1))) return tok(2, TLexer::SubID);
+        for (auto &[kw, type] : g_keywords)
+            if (text == kw) return tok(len, type);
+        return tok(len, TLexer::Token);
+    }
+}
+
+rd_parser::rd_parser(antlr4::CharStream &is) : _buffer{ is.toString() }, _lexer{ _buffer, &is } { }
+
+rd_parser::rd_parser(std::string_view src, antlr4::CharStream &is) : _lexer{ src, &is } { }
+
+antlr4::Token *rd_parser::LT(size_t k) {
+    while (_tokens.size() < _pos + k) {
+        if (!_tokens.empty() && _tokens.back()->getType() == antlr4::Token::EOF)
+            return _tokens.back().get();
+        _tokens.emplace_back(_lexer.next());
+        _tokens.back()->setTokenIndex(_n_lexed++);
+        _peak = std::max(_peak, _tokens.size());
+    }
+    return _tokens[_pos + k - 1].get();
+}
+
+bool rd_parser::LA_is_value(size_t k) {
+    auto t = LA(k);
+    return t == TParser::Dollar || t == TParser::SingleString || t == TParser::DoubleString;
+}
+
+// collectOperation: stage (Single Token assignment*)? Append;
+// Look past an optional Bra for the above, as pipe and pipeGroup start the same way.
+bool rd_parser::predict_collect() {
+    size_t k = 1;
+    if (LA(k) == TParser::Bra) k++;
+    if (!LA_is_stage(k++)) return false;
+    if (LA(k) == TParser::Append) return true;
+    if (LA(k) != TParser::Single || LA(k + 1) != TParser::Token) return false;
+    for (k += 2; LA(k) == TParser::Assign;) {
+        k++;
+        if (LA(k) == TParser::Dollar)
+            k += 2;
+        else if (LA(k) == TParser::SingleString || LA(k) == TParser::DoubleString)
+            k++;
+    }
+    return LA(k) == TParser::Append;
+}
+
+// pipe: stage (NL1? alsoGroup)* operAlso; versus a lone stage.
+bool rd_parser::predict_pipe() {
+    if (LA(1) == TParser::Bra) return true;
+    if (LA(2) == TParser::KAlso || LA_is_oper(2)) return true;
+    return LA(2) == TParser::NL1 && (LA(3) == TParser::KAlso || LA_is_oper(3));
+}
+
+// operAlso: (NL1? operation NL1? (alsoGroup NL1?)*)+;
+bool rd_parser::predict_operAlso() {
+    return LA_is_oper(1) || (LA(1) == TParser::NL1 && LA_is_oper(2));
+}
+
+// The NL1? after an operation or alsoGroup is greedy, unless nothing could
+// follow it and the enclosing rule needs the newline for itself.
+bool rd_parser::predict_trailing_nl() {
+    if (LA(1) != TParser::NL1) return false;
+    switch (LA(2)) {
+        case TParser::KAlso:
+        case TParser::Mult:
+        case TParser::Single:
+        case TParser::Exclamation:
+        case TParser::TemplateName:
+        case TParser::NL1:
+        case TParser::Tilde:
+        case TParser::Ket:
+            return true;
+        default:
+            return false;
+    }
+}
+
+template <typename T>
+T *rd_parser::enter(ctx_t *parent) {
+    auto ctx = new T(parent, 0);
+    _nodes.emplace_back(ctx);
+    if (parent) parent->addChild(ctx);
+    ctx->start = LT(1);
+    return ctx;
+}
+
+void rd_parser::leave(ctx_t *ctx) {
+    ctx->stop = _pos ? _tokens[_pos - 1].get() : nullptr;
+}
+
+void rd_parser::match(ctx_t *ctx, size_t type) {
+    if (LA(1) != type)
+        fail(type == antlr4::Token::EOF ? "<EOF>"s : "token #" + std::to_string(type));
+    auto node = new antlr4::tree::TerminalNodeImpl(_tokens[_pos++].get());
+    _nodes.emplace_back(node);
+    ctx->addChild(node);
+}
+
+void rd_parser::match_opt(ctx_t *ctx, size_t type) {
+    if (LA(1) == type)
+        match(ctx, type);
+}
+
+void rd_parser::fail(const std::string &expecting) {
+    auto tok = LT(1);
+    throw rd_error{ tok->getLine(), tok->getCharPositionInLine(), false,
+                    "mismatched input '" + tok->getText() + "' expecting " + expecting };
+}
+
+// main: (nl | stmt | literal)* EOF;
+TParser::MainContext *rd_parser::main() {
+    auto ctx = enter<TParser::MainContext>(nullptr);
+    while (item(ctx));
+    match(ctx, antlr4::Token::EOF);
+    leave(ctx);
+    return ctx;
+}
+
+antlr4::ParserRuleContext *rd_parser::next() {
+    _nodes.clear();
+    _tokens.erase(_tokens.begin(), _tokens.begin() + static_cast<ssize_t>(_pos));
+    _pos = 0;
+    if (!item(nullptr))
+        return nullptr;
+    return dynamic_cast<ctx_t *>(_nodes.front().get());
+}
+
+// (nl | stmt | literal), or false at EOF.
+bool rd_parser::item(ctx_t *p) {
+    switch (LA(1)) {
+        case TParser::NL1:
+            nl(p);
+            return true;
+        case TParser::LiteralProlog:
+        case TParser::LiteralEmptyText:
+            literal(p);
+            return true;
+        case antlr4::Token::EOF:
+            return false;
+        default:
+            stmt(p);
+            return true;
+    }
+}
+
+void rd_parser::stmt(ctx_t *p) {
+    auto ctx = enter<TParser::StmtContext>(p);
+    switch (LA(1)) {
+        case TParser::KPrint:
+            debugStmt(ctx);
+            break;
+        case TParser::KClear:
+            clearStmt(ctx);
+            break;
+        case TParser::KIf:
+            conditionalStmt(ctx);
+            break;
+        case TParser::KRule:
+            ruleStmt(ctx);
+            break;
+        case TParser::KInclude:
+            if (LA(2) == TParser::KFile)
+                fileStmt(ctx);
+            else
+                includeStmt(ctx);
+            break;
+        case TParser::KList:
+            listStmt(ctx);
+            break;
+        case TParser::KForeach:
+            if (LA(2) == TParser::KList)
+                listGroupStmt(ctx);
+            else
+                foreachGroupStmt(ctx);
+            break;
+        case TParser::KTemplate:
+            templateStmt(ctx);
+            break;
+        case TParser::KExecute:
+            executeStmt(ctx);
+            break;
+        case TParser::KMeta:
+            metaStmt(ctx);
+            break;
+        case TParser::KPool:
+            poolStmt(ctx);
+            break;
+        case TParser::Stage:
+        case TParser::KDefault:
+        case TParser::Bra:
+            if (predict_collect())
+                collectGroupStmt(ctx);
+            else
+                pipeStmt(ctx);
+            break;
+        default:
+            fail("a statement");
+    }
+    leave(ctx);
+}
+
+// stmts: OpenCurly nl stmt+ CloseCurly;
+void rd_parser::stmts(ctx_t *p) {
+    auto ctx = enter<TParser::StmtsContext>(p);
+    match(ctx, TParser::OpenCurly);
+    nl(ctx);
+    do stmt(ctx);
+    while (LA(1) != TParser::CloseCurly);
+    match(ctx, TParser::CloseCurly);
+    leave(ctx);
+}
+
+// fragmentStmts: OpenDoubleCurly nl stmt+ CloseDoubleCurly;
+void rd_parser::fragmentStmts(ctx_t *p) {
+    auto ctx = enter<TParser::FragmentStmtsContext>(p);
+    match(ctx, TParser::OpenDoubleCurly);
+    nl(ctx);
+    do stmt(ctx);
+    while (LA(1) != TParser::CloseDoubleCurly);
+    match(ctx, TParser::CloseDoubleCurly);
+    leave(ctx);
+}
+
+// debugStmt: KPrint KList ID nl;
+void rd_parser::debugStmt(ctx_t *p) {
+    auto ctx = enter<TParser::DebugStmtContext>(p);
+    match(ctx, TParser::KPrint);
+    match(ctx, TParser::KList);
+    match(ctx, TParser::ID);
+    nl(ctx);
+    leave(ctx);
+}
+
+// clearStmt: KClear KList ID nl;
+void rd_parser::clearStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ClearStmtContext>(p);
+    match(ctx, TParser::KClear);
+    match(ctx, TParser::KList);
+    match(ctx, TParser::ID);
+    nl(ctx);
+    leave(ctx);
+}
+
+// conditionalStmt: ifStmt nl;
+void rd_parser::conditionalStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ConditionalStmtContext>(p);
+    ifStmt(ctx);
+    nl(ctx);
+    leave(ctx);
+}
+
+// ifStmt: KIf (IsEmpty | IsNonEmpty) Dollar SubID stmts (KElse (ifStmt | stmts))?;
+void rd_parser::ifStmt(ctx_t *p) {
+    auto ctx = enter<TParser::IfStmtContext>(p);
+    match(ctx, TParser::KIf);
+    match(ctx, LA(1) == TParser::IsEmpty ? TParser::IsEmpty : TParser::IsNonEmpty);
+    match(ctx, TParser::Dollar);
+    match(ctx, TParser::SubID);
+    stmts(ctx);
+    if (LA(1) == TParser::KElse) {
+        match(ctx, TParser::KElse);
+        if (LA(1) == TParser::KIf)
+            ifStmt(ctx);
+        else
+            stmts(ctx);
+    }
+    leave(ctx);
+}
+
+// ruleStmt: KRule Token* ((RuleAppend | RuleAppend2) stage+ | assignment+) nl;
+void rd_parser::ruleStmt(ctx_t *p) {
+    auto ctx = enter<TParser::RuleStmtContext>(p);
+    match(ctx, TParser::KRule);
+    while (LA(1) == TParser::Token)
+        match(ctx, TParser::Token);
+    if (LA(1) == TParser::RuleAppend || LA(1) == TParser::RuleAppend2) {
+        match(ctx, LA(1));
+        do stage(ctx);
+        while (LA_is_stage(1));
+    } else {
+        do assignment(ctx);
+        while (LA(1) == TParser::Assign);
+    }
+    nl(ctx);
+    leave(ctx);
+}
+
+// includeStmt: KInclude KList ID ListSearch Path;
+void rd_parser::includeStmt(ctx_t *p) {
+    auto ctx = enter<TParser::IncludeStmtContext>(p);
+    match(ctx, TParser::KInclude);
+    match(ctx, TParser::KList);
+    match(ctx, TParser::ID);
+    match(ctx, TParser::ListSearch);
+    match(ctx, TParser::Path);
+    leave(ctx);
+}
+
+// listStmt: KList ID (listSearchStmt | listEnumStmt | listInlineEnumStmt | listModifyStmt);
+void rd_parser::listStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ListStmtContext>(p);
+    match(ctx, TParser::KList);
+    match(ctx, TParser::ID);
+    switch (LA(1)) {
+        case TParser::ListSearch:
+            listSearchStmt(ctx);
+            break;
+        case TParser::ListEnum:
+            if (LA(2) == TParser::ListItemNL)
+                listEnumStmt(ctx);
+            else
+                listInlineEnumStmt(ctx);
+            break;
+        case TParser::KSort:
+        case TParser::KUnique:
+        case TParser::Token:
+            listModifyStmt(ctx);
+            break;
+        default:
+            fail("':=', '::=', 'sort', 'uniq', 'union', 'intersect' or 'except'");
+    }
+    leave(ctx);
+}
+
+// listModifyStmt: (KSort KDesc? KUnique? | KUnique | Token ID) nl;
+void rd_parser::listModifyStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ListModifyStmtContext>(p);
+    if (LA(1) == TParser::KSort) {
+        match(ctx, TParser::KSort);
+        match_opt(ctx, TParser::KDesc);
+        match_opt(ctx, TParser::KUnique);
+    } else if (LA(1) == TParser::KUnique) {
+        match(ctx, TParser::KUnique);
+    } else {
+        match(ctx, TParser::Token);
+        match(ctx, TParser::ID);
+    }
+    nl(ctx);
+    leave(ctx);
+}
+
+// listSearchStmt: ListSearch Path;
+void rd_parser::listSearchStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ListSearchStmtContext>(p);
+    match(ctx, TParser::ListSearch);
+    match(ctx, TParser::Path);
+    leave(ctx);
+}
+
+// listEnumStmt: ListEnum ListItemNL listEnumStmtItem+ nl?;
+void rd_parser::listEnumStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ListEnumStmtContext>(p);
+    match(ctx, TParser::ListEnum);
+    match(ctx, TParser::ListItemNL);
+    do listEnumStmtItem(ctx);
+    while (LA(1) == TParser::ListEnumItem || LA(1) == TParser::ListEnumRItem);
+    if (LA(1) == TParser::NL1)
+        nl(ctx);
+    leave(ctx);
+}
+
+// listEnumStmtItem: (ListEnumItem | ListEnumRItem) ListItemToken+ ListItemNL;
+void rd_parser::listEnumStmtItem(ctx_t *p) {
+    auto ctx = enter<TParser::ListEnumStmtItemContext>(p);
+    match(ctx, LA(1) == TParser::ListEnumRItem ? TParser::ListEnumRItem : TParser::ListEnumItem);
+    do match(ctx, TParser::ListItemToken);
+    while (LA(1) == TParser::ListItemToken);
+    match(ctx, TParser::ListItemNL);
+    leave(ctx);
+}
+
+// listInlineEnumStmt: ListEnum ListItemToken+ ListItemNL nl?;
+void rd_parser::listInlineEnumStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ListInlineEnumStmtContext>(p);
+    match(ctx, TParser::ListEnum);
+    do match(ctx, TParser::ListItemToken);
+    while (LA(1) == TParser::ListItemToken);
+    match(ctx, TParser::ListItemNL);
+    if (LA(1) == TParser::NL1)
+        nl(ctx);
+    leave(ctx);
+}
+
+// foreachGroupStmt: KForeach (ID | SubID) ((Times | Tilde) (ID | SubID))* (stmts | fragmentStmts) nl;
+void rd_parser::foreachGroupStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ForeachGroupStmtContext>(p);
+    match(ctx, TParser::KForeach);
+    match(ctx, LA(1) == TParser::SubID ? TParser::SubID : TParser::ID);
+    while (LA(1) == TParser::Times || LA(1) == TParser::Tilde) {
+        match(ctx, LA(1));
+        match(ctx, LA(1) == TParser::SubID ? TParser::SubID : TParser::ID);
+    }
+    if (LA(1) == TParser::OpenDoubleCurly)
+        fragmentStmts(ctx);
+    else
+        stmts(ctx);
+    nl(ctx);
+    leave(ctx);
+}
+
+// collectGroupStmt: (Bra collectOperation Ket KAlso | collectOperation) (collectGroupStmt | stmts nl);
+void rd_parser::collectGroupStmt(ctx_t *p) {
+    auto ctx = enter<TParser::CollectGroupStmtContext>(p);
+    if (LA(1) == TParser::Bra) {
+        match(ctx, TParser::Bra);
+        collectOperation(ctx);
+        match(ctx, TParser::Ket);
+        match(ctx, TParser::KAlso);
+    } else {
+        collectOperation(ctx);
+    }
+    if (LA(1) == TParser::OpenCurly) {
+        stmts(ctx);
+        nl(ctx);
+    } else {
+        collectGroupStmt(ctx);
+    }
+    leave(ctx);
+}
+
+// collectOperation: stage (Single Token assignment*)? Append;
+void rd_parser::collectOperation(ctx_t *p) {
+    auto ctx = enter<TParser::CollectOperationContext>(p);
+    stage(ctx);
+    if (LA(1) == TParser::Single) {
+        match(ctx, TParser::Single);
+        match(ctx, TParser::Token);
+        while (LA(1) == TParser::Assign)
+            assignment(ctx);
+    }
+    match(ctx, TParser::Append);
+    leave(ctx);
+}
+
+// listGroupStmt: KForeach KList ID ListSearch (OpenCurlyPath nl? stmt+ CloseCurly
+//     | OpenDoubleCurlyPath nl? stmt+ CloseDoubleCurly) nl;
+void rd_parser::listGroupStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ListGroupStmtContext>(p);
+    match(ctx, TParser::KForeach);
+    match(ctx, TParser::KList);
+    match(ctx, TParser::ID);
+    match(ctx, TParser::ListSearch);
+    auto close = LA(1) == TParser::OpenDoubleCurlyPath ? TParser::CloseDoubleCurly : TParser::CloseCurly;
+    match(ctx, LA(1) == TParser::OpenDoubleCurlyPath ? TParser::OpenDoubleCurlyPath : TParser::OpenCurlyPath);
+    if (LA(1) == TParser::NL1)
+        nl(ctx);
+    do stmt(ctx);
+    while (LA(1) != close);
+    match(ctx, close);
+    nl(ctx);
+    leave(ctx);
+}
+
+// pipeStmt: (pipe | stage) (Exclamation | NL1? templateInst)? nl;
+void rd_parser::pipeStmt(ctx_t *p) {
+    auto ctx = enter<TParser::PipeStmtContext>(p);
+    if (predict_pipe())
+        pipe(ctx);
+    else
+        stage(ctx);
+    if (LA(1) == TParser::Exclamation) {
+        match(ctx, TParser::Exclamation);
+    } else if (LA(1) == TParser::TemplateName || (LA(1) == TParser::NL1 && LA(2) == TParser::TemplateName)) {
+        match_opt(ctx, TParser::NL1);
+        templateInst(ctx);
+    }
+    nl(ctx);
+    leave(ctx);
+}
+
+// pipeGroup: Bra NL1? artifact* Ket;
+void rd_parser::pipeGroup(ctx_t *p) {
+    auto ctx = enter<TParser::PipeGroupContext>(p);
+    match(ctx, TParser::Bra);
+    match_opt(ctx, TParser::NL1);
+    while (LA_is_stage(1) || LA(1) == TParser::Bra)
+        artifact(ctx);
+    match(ctx, TParser::Ket);
+    leave(ctx);
+}
+
+// artifact: (stage | pipe) (Tilde Tilde?)? NL1?;
+void rd_parser::artifact(ctx_t *p) {
+    auto ctx = enter<TParser::ArtifactContext>(p);
+    if (predict_pipe())
+        pipe(ctx);
+    else
+        stage(ctx);
+    if (LA(1) == TParser::Tilde) {
+        match(ctx, TParser::Tilde);
+        match_opt(ctx, TParser::Tilde);
+    }
+    match_opt(ctx, TParser::NL1);
+    leave(ctx);
+}
+
+// pipe: (stage (NL1? alsoGroup)* | pipeGroup) operAlso;
+void rd_parser::pipe(ctx_t *p) {
+    auto ctx = enter<TParser::PipeContext>(p);
+    if (LA(1) == TParser::Bra) {
+        pipeGroup(ctx);
+    } else {
+        stage(ctx);
+        while (LA(1) == TParser::KAlso || (LA(1) == TParser::NL1 && LA(2) == TParser::KAlso)) {
+            match_opt(ctx, TParser::NL1);
+            alsoGroup(ctx);
+        }
+    }
+    operAlso(ctx);
+    leave(ctx);
+}
+
+// stage: Stage | KDefault;
+void rd_parser::stage(ctx_t *p) {
+    auto ctx = enter<TParser::StageContext>(p);
+    match(ctx, LA(1) == TParser::KDefault ? TParser::KDefault : TParser::Stage);
+    leave(ctx);
+}
+
+// operAlso: (NL1? operation NL1? (alsoGroup NL1?)*)+;
+void rd_parser::operAlso(ctx_t *p) {
+    auto ctx = enter<TParser::OperAlsoContext>(p);
+    do {
+        match_opt(ctx, TParser::NL1);
+        operation(ctx);
+        if (predict_trailing_nl())
+            match(ctx, TParser::NL1);
+        while (LA(1) == TParser::KAlso) {
+            alsoGroup(ctx);
+            if (predict_trailing_nl())
+                match(ctx, TParser::NL1);
+        }
+    } while (predict_operAlso());
+    leave(ctx);
+}
+
+// operation: (Mult | Single) (Token (assignment+ | (NL1 assignment)+ NL1)? Single)? stage;
+void rd_parser::operation(ctx_t *p) {
+    auto ctx = enter<TParser::OperationContext>(p);
+    match(ctx, LA(1) == TParser::Mult ? TParser::Mult : TParser::Single);
+    if (LA(1) == TParser::Token) {
+        match(ctx, TParser::Token);
+        if (LA(1) == TParser::Assign) {
+            do assignment(ctx);
+            while (LA(1) == TParser::Assign);
+        } else if (LA(1) == TParser::NL1 && LA(2) == TParser::Assign) {
+            do {
+                match(ctx, TParser::NL1);
+                assignment(ctx);
+            } while (LA(1) == TParser::NL1 && LA(2) == TParser::Assign);
+            match(ctx, TParser::NL1);
+        }
+        match(ctx, TParser::Single);
+    }
+    stage(ctx);
+    leave(ctx);
+}
+
+// alsoGroup: KAlso Bra (operAlso Exclamation? | operAlso? NL1? templateInst)? Ket;
+void rd_parser::alsoGroup(ctx_t *p) {
+    auto ctx = enter<TParser::AlsoGroupContext>(p);
+    match(ctx, TParser::KAlso);
+    match(ctx, TParser::Bra);
+    auto ex = false;
+    if (predict_operAlso()) {
+        operAlso(ctx);
+        if (LA(1) == TParser::Exclamation)
+            match(ctx, TParser::Exclamation), ex = true;
+    }
+    if (!ex && (LA(1) == TParser::TemplateName || (LA(1) == TParser::NL1 && LA(2) == TParser::TemplateName))) {
+        match_opt(ctx, TParser::NL1);
+        templateInst(ctx);
+    }
+    match(ctx, TParser::Ket);
+    leave(ctx);
+}
+
+// assignment: Assign value?;
+void rd_parser::assignment(ctx_t *p) {
+    auto ctx = enter<TParser::AssignmentContext>(p);
+    match(ctx, TParser::Assign);
+    if (LA_is_value(1))
+        value(ctx);
+    leave(ctx);
+}
+
+// value: Dollar ID | Dollar SubID | SingleString | DoubleString;
+void rd_parser::value(ctx_t *p) {
+    auto ctx = enter<TParser::ValueContext>(p);
+    switch (LA(1)) {
+        case TParser::Dollar:
+            match(ctx, TParser::Dollar);
+            match(ctx, LA(1) == TParser::SubID ? TParser::SubID : TParser::ID);
+            break;
+        case TParser::SingleString:
+            match(ctx, TParser::SingleString);
+            break;
+        default:
+            match(ctx, TParser::DoubleString);
+            break;
+    }
+    leave(ctx);
+}
+
+// literal: prolog;
+void rd_parser::literal(ctx_t *p) {
+    auto ctx = enter<TParser::LiteralContext>(p);
+    prolog(ctx);
+    leave(ctx);
+}
+
+// prolog: LiteralProlog LiteralNL | LiteralEmptyText;
+void rd_parser::prolog(ctx_t *p) {
+    auto ctx = enter<TParser::PrologContext>(p);
+    if (LA(1) == TParser::LiteralProlog) {
+        match(ctx, TParser::LiteralProlog);
+        match(ctx, TParser::LiteralNL);
+    } else {
+        match(ctx, TParser::LiteralEmptyText);
+    }
+    leave(ctx);
+}
+
+// fileStmt: KInclude KFile ListSearch Path;
+void rd_parser::fileStmt(ctx_t *p) {
+    auto ctx = enter<TParser::FileStmtContext>(p);
+    match(ctx, TParser::KInclude);
+    match(ctx, TParser::KFile);
+    match(ctx, TParser::ListSearch);
+    match(ctx, TParser::Path);
+    leave(ctx);
+}
+
+// templateStmt: KTemplate Token KList ID (stage? NL1 operAlso? | pipeGroup NL1? operAlso)
+//     (Exclamation | NL1? templateInst)? nl;
+void rd_parser::templateStmt(ctx_t *p) {
+    auto ctx = enter<TParser::TemplateStmtContext>(p);
+    match(ctx, TParser::KTemplate);
+    match(ctx, TParser::Token);
+    match(ctx, TParser::KList);
+    match(ctx, TParser::ID);
+    if (LA(1) == TParser::Bra) {
+        pipeGroup(ctx);
+        match_opt(ctx, TParser::NL1);
+        operAlso(ctx);
+    } else {
+        if (LA_is_stage(1))
+            stage(ctx);
+        match(ctx, TParser::NL1);
+        if (predict_operAlso())
+            operAlso(ctx);
+    }
+    if (LA(1) == TParser::Exclamation) {
+        match(ctx, TParser::Exclamation);
+    } else if (LA(1) == TParser::TemplateName || (LA(1) == TParser::NL1 && LA(2) == TParser::TemplateName)) {
+        match_opt(ctx, TParser::NL1);
+        templateInst(ctx);
+    }
+    nl(ctx);
+    leave(ctx);
+}
+
+// templateInst: TemplateName value+ Exclamation?;
+void rd_parser::templateInst(ctx_t *p) {
+    auto ctx = enter<TParser::TemplateInstContext>(p);
+    match(ctx, TParser::TemplateName);
+    do value(ctx);
+    while (LA_is_value(1));
+    match_opt(ctx, TParser::Exclamation);
+    leave(ctx);
+}
+
+// executeStmt: KExecute Times? ListSearch Path nl?;
+void rd_parser::executeStmt(ctx_t *p) {
+    auto ctx = enter<TParser::ExecuteStmtContext>(p);
+    match(ctx, TParser::KExecute);
+    match_opt(ctx, TParser::Times);
+    match(ctx, TParser::ListSearch);
+    match(ctx, TParser::Path);
+    if (LA(1) == TParser::NL1)
+        nl(ctx);
+    leave(ctx);
+}
+
+// metaStmt: KMeta RuleAppend stage+ nl?;
+void rd_parser::metaStmt(ctx_t *p) {
+    auto ctx = enter<TParser::MetaStmtContext>(p);
+    match(ctx, TParser::KMeta);
+    match(ctx, TParser::RuleAppend);
+    do stage(ctx);
+    while (LA_is_stage(1));
+    if (LA(1) == TParser::NL1)
+        nl(ctx);
+    leave(ctx);
+}
+
+// poolStmt: KPool Token (RuleAppend stage+ nl | ListSearch Path nl?);
+void rd_parser::poolStmt(ctx_t *p) {
+    auto ctx = enter<TParser::PoolStmtContext>(p);
+    match(ctx, TParser::KPool);
+    match(ctx, TParser::Token);
+    if (LA(1) == TParser::RuleAppend) {
+        match(ctx, TParser::RuleAppend);
+        do stage(ctx);
+        while (LA_is_stage(1));
+        nl(ctx);
+    } else {
+        match(ctx, TParser::ListSearch);
+        match(ctx, TParser::Path);
+        if (LA(1) == TParser::NL1)
+            nl(ctx);
+    }
+    leave(ctx);
+}
+
+// nl: NL1+;
+void rd_parser::nl(ctx_t *p) {
+    auto ctx = enter<TParser::NlContext>(p);
+    do match(ctx, TParser::NL1);
+    while (LA(1) == TParser::NL1);
+    leave(ctx);
+}
+
+static void flatten(antlr4::tree::ParseTree *t, std::vector<antlr4::tree::ParseTree *> &out) {
+    if (auto term = dynamic_cast<antlr4::tree::TerminalNode *>(t)) {
+        if (term->getSymbol()->getType() != TParser::NL1)
+            out.push_back(t);
+        return;
+    }
+    if (dynamic_cast<TParser::NlContext *>(t))
+        return;
+    out.push_back(t);
+    for (auto c : t->children)
+        flatten(c, out);
+    out.push_back(nullptr);
+}
+
+antlr4::Token *rd_parser::mismatch(antlr4::tree::ParseTree *lhs, antlr4::tree::ParseTree *rhs) {
+    std::vector<antlr4::tree::ParseTree *> l, r;
+    flatten(lhs, l);
+    flatten(rhs, r);
+    antlr4::Token *last{};
+    for (size_t i{}; i < l.size() || i < r.size(); i++) {
+        auto a = i < l.size() ? l[i] : nullptr;
+        auto b = i < r.size() ? r[i] : nullptr;
+        if (i >= l.size() || i >= r.size())
+            return last;
+        if (!a || !b) {
+            if (a != b) return last;
+            continue;
+        }
+        auto ta = dynamic_cast<antlr4::tree::TerminalNode *>(a);
+        auto tb = dynamic_cast<antlr4::tree::TerminalNode *>(b);
+        if (ta) last = ta->getSymbol();
+        if (!ta != !tb)
+            return last;
+        if (ta) {
+            if (ta->getSymbol()->getType() != tb->getSymbol()->getType())
+                return last;
+            if (ta->getSymbol()->getType() != antlr4::Token::EOF && ta->getText() != tb->getText())
+                return last;
+        } else {
+            auto ra = dynamic_cast<antlr4::RuleContext *>(a);
+            auto rb = dynamic_cast<antlr4::RuleContext *>(b);
+            last = dynamic_cast<antlr4::ParserRuleContext *>(a)->getStart();
+            if (ra->getRuleIndex() != rb->getRuleIndex())
+                return last;
+        }
+    }
+    return nullptr;
+}
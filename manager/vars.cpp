@@ -0,0 +1,111 @@
+/* Copyright (C) 2021-2023 b1f6c1c4
+ *
+ * This file is part of ajnin.
+ *
+ * ajnin is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, version 3.
+ *
+ * ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vars.hpp"
+
+#include <unordered_map>
+
+using namespace parsing;
+
+namespace {
+    // Every set alive, by hash. Each set removes itself once the last copy is gone.
+    // Never destroyed, since sets may outlive any static object.
+    template <typename T>
+    auto &pool() {
+        static auto &p = *new std::unordered_multimap<size_t, std::weak_ptr<const T>>;
+        return p;
+    }
+
+    size_t hash_of(const vars_t::map_t &m) {
+        std::hash<std::string> h;
+        size_t res = m.size();
+        for (auto &[k, v] : m) {
+            res ^= h(k) + 0x9e3779b97f4a7c15ull + (res << 6) + (res >> 2);
+            res ^= h(v) + 0x9e3779b97f4a7c15ull + (res << 6) + (res >> 2);
+        }
+        return res;
+    }
+}
+
+vars_t::vars_t(map_t &&m) {
+    if (m.empty())
+        return;
+    auto h = hash_of(m);
+    auto &p = pool<node_t>();
+    auto [b, e] = p.equal_range(h);
+    for (auto it = b; it != e; ++it)
+        if (auto n = it->second.lock(); n && n->map == m) {
+            _node = std::move(n);
+            return;
+        }
+    std::shared_ptr<const node_t> n{ new node_t{ std::move(m), h }, [](const node_t *n) {
+        auto &p = pool<node_t>();
+        auto [b, e] = p.equal_range(n->hash);
+        for (auto it = b; it != e; ++it)
+            if (it->second.expired()) { // Nobody else can be expired right now.
+                p.erase(it);
+                break;
+            }
+        delete n;
+    } };
+    p.emplace(h, n);
+    _node = std::move(n);
+}
+
+const vars_t::map_t &vars_t::empty_map() {
+    static const map_t m;
+    return m;
+}
+
+const std::string *vars_t::find(const std::string &k) const {
+    if (!_node) return nullptr;
+    auto it = _node->map.find(k);
+    return it == _node->map.end() ? nullptr : &it->second;
+}
+
+vars_t vars_t::with(const std::string &k, std::string v) const {
+    if (auto p = find(k); p && *p == v)
+        return *this;
+    auto m = **this;
+    m[k] = std::move(v);
+    return vars_t{ std::move(m) };
+}
+
+vars_t vars_t::without(const std::string &k) const {
+    if (!find(k))
+        return *this;
+    auto m = **this;
+    m.erase(k);
+    return vars_t{ std::move(m) };
+}
+
+vars_t vars_t::merge(const vars_t &o) const {
+    if (o.empty() || o == *this)
+        return *this;
+    if (empty())
+        return o;
+    auto m = **this;
+    for (auto &[k, v] : o)
+        m[k] = v;
+    return vars_t{ std::move(m) };
+}
+
+void vars_t::visit(const std::function<void(const map_t &)> &f) {
+    for (auto &[h, w] : pool<node_t>())
+        if (auto n = w.lock())
+            f(n->map);
+}
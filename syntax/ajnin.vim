@@ -39,6 +39,8 @@ syn match ajninKeyword "\<also\>" skipwhite
 syn match ajninKeyword "\<sort\>" skipwhite
 syn match ajninKeyword "\<uniq\>" skipwhite
 syn match ajninKeyword "\<desc\>" skipwhite
+" Only keywords right after list X.
+syn match ajninKeyword "\(\<list\s\+\a\s\+\)\@<=\(union\|intersect\|except\)\>" skipwhite
 syn match ajninKeyword "\<print\>" skipwhite
 syn match ajninKeyword "\<clear\>" skipwhite
 syn match ajninKeyword "\<file\>" skipwhite
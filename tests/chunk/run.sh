@@ -0,0 +1,52 @@
+#!/bin/sh
+# Copyright (C) 2021-2023 b1f6c1c4
+#
+# This file is part of ajnin.
+#
+# ajnin is free software: you can redistribute it and/or modify it under the
+# terms of the GNU Affero General Public License as published by the Free
+# Software Foundation, version 3.
+#
+# ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+# more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+
+# Usage: run.sh <ajnin>
+# Reads a generated list of over 8 MiB both from a file, in parallel chunks,
+# and from a command, line by line, and compares the items, in order.
+set -eu
+AJNIN=$1
+SRC=$(cd "$(dirname "$0")" && pwd)
+rm -rf chunk.d
+mkdir chunk.d
+cd chunk.d
+
+# Wherever a chunk is cut, it may land on a comment, on a line continued by \,
+# or within a comment among continued lines.
+awk 'BEGIN {
+    pad = sprintf("%080d", 0)
+    for (i = 0; i < 120000; i++) {
+        if (i % 7 == 0)
+            print "# comment " i " " pad
+        if (i % 3 == 0) {
+            print "item" i "/" pad " \\"
+            if (i % 5 == 0)
+                print "# within " i
+            print "arg" i " \\"
+            print "last" i
+        } else {
+            print "item" i "/" pad
+        }
+    }
+}' > big.txt
+test "$(wc -c < big.txt)" -ge $((8 << 20))
+
+"$AJNIN" --bare -q --no-prefix-vars "$SRC/chunk.ajnin" -o out.ninja
+sed -n 's/^build file: phony //p' out.ninja > file.txt
+sed -n 's/^build command: phony //p' out.ninja > command.txt
+test -s file.txt
+cmp file.txt command.txt
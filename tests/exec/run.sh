@@ -0,0 +1,57 @@
+#!/bin/sh
+# Copyright (C) 2021-2023 b1f6c1c4
+#
+# This file is part of ajnin.
+#
+# ajnin is free software: you can redistribute it and/or modify it under the
+# terms of the GNU Affero General Public License as published by the Free
+# Software Foundation, version 3.
+#
+# ajnin is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for
+# more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with ajnin.  If not, see <https://www.gnu.org/licenses/>.
+
+# Usage: run.sh <ajnin> <case>
+# Runs tests/exec/<case>.ajnin in a scratch directory of its own.
+set -eu
+AJNIN=$1
+SRC=$(cd "$(dirname "$0")" && pwd)
+rm -rf "exec.$2"
+mkdir "exec.$2"
+cd "exec.$2"
+
+lines() {
+    wc -l < "$1" | tr -d ' '
+}
+
+case "$2" in
+cache)
+    run() { "$AJNIN" --bare -q --exec-cache cache.txt "$SRC/cache.ajnin" -o out.ninja; }
+    echo 1 > in.txt
+    run # Miss.
+    run # Hit.
+    test "$(lines runs.txt)" = 1
+    echo 22 > in.txt
+    run # Stale; its entry is replaced.
+    test "$(lines runs.txt)" = 2
+    test "$(lines cache.txt)" = 1
+    run
+    test "$(lines runs.txt)" = 2
+    test "$(lines always.txt)" = 4 # Without inputs, never cached.
+    ;;
+async)
+    "$AJNIN" --bare -q "$SRC/async.ajnin" -o out.ninja
+    grep -qx 'build b: phony a' out.ninja # Waited for before include.
+    grep -qx '(c) -- (d)' copy.txt # Waited for before execute.
+    ;;
+fail)
+    if "$AJNIN" --bare -q "$SRC/fail.ajnin" -o out.ninja 2> err.txt; then
+        exit 1
+    fi
+    grep -q 'External command exit 3 failed' err.txt
+    ;;
+esac